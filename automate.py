@@ -1,12 +1,5 @@
 import subprocess
 import os
-from PIL import Image
-
-def convert_ppm_to_jpg(input_file, output_file):
-    # Open the PPM file
-    with Image.open(input_file) as im:
-        # Save the image as JPG
-        im.save(output_file, 'JPEG')
 
 def run_command(command, cwd=None):
     """Run a shell command and return the output and error."""
@@ -36,18 +29,14 @@ def main():
     os.makedirs(release_dir, exist_ok=True)
     
 
+    # The raytracer encodes PNG itself, so no conversion step is needed
+    output_path = os.path.abspath('output.png')
+
     print("Running the executable...")
-    stdout, stderr = run_command("raytracer.exe", cwd=release_dir)
+    stdout, stderr = run_command(f'raytracer.exe --output "{output_path}"', cwd=release_dir)
     print("Executable Output:", stdout)
     print("Executable Error:", stderr)
 
-
-    input_path = 'build/Release/out.ppm'
-    output_path = 'output.jpg'
-
-    # Convert the image
-    convert_ppm_to_jpg(input_path, output_path)
-
     print(f"Image saved as {output_path}")
 
 if __name__ == "__main__":
@@ -3,6 +3,60 @@
 #include <fstream>
 #include <algorithm>
 #include <cmath>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <random>
+#include <sstream>
+#include <charconv>
+#include <unordered_map>
+#include <memory>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// SIMD kernels must round like the scalar code, so targets that bring FMA (avx512f) may not contract mul/add pairs
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RT_SIMD_X86 1
+#if defined(__clang__)
+#define RT_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RT_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#endif
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define RT_SIMD_X86 1
+#define RT_TARGET(isa)
+#include <intrin.h>
+#else
+#define RT_SIMD_X86 0
+#endif
 
 // Vector class definition
 struct vec3 {
@@ -23,12 +77,18 @@ vec3 cross(const vec3 v1, const vec3 v2) {
     return { v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x };
 }
 
+// Component-wise product, used to tint by a colour
+vec3 mul(const vec3& a, const vec3& b) {
+    return { a.x * b.x, a.y * b.y, a.z * b.z };
+}
+
 // Material structure definition
 struct Material {
     float refractive_index = 1;
     float albedo[4] = { 2, 0, 0, 0 };
     vec3 diffuse_color = { 0, 0, 0 };
     float specular_exponent = 0;
+    int texture = -1; // index into Scene::textures replacing diffuse_color, -1 for none
 };
 
 // Sphere structure definition
@@ -50,6 +110,7 @@ constexpr Material marble = { 1.0, {0.8, 0.2, 0.0, 0.0}, {0.5, 0.5, 0.5}, 30. };
 constexpr Material water = { 1.3, {0.1, 0.4, 0.7, 0.5}, {0.2, 0.5, 0.8}, 100. };
 constexpr Material shiny_red = { 1.0, {1.2, 0.3, 0.0, 0.1}, {0.7, 0.1, 0.1}, 200. };
 constexpr Material bronze = { 1.0, {0.4, 0.3, 0.2, 0.1}, {0.8, 0.7, 0.5}, 500. };
+constexpr Material mirror = { 1.0, {0.0, 10.0, 0.8, 0.0}, {1.0, 1.0, 1.0}, 1425. };
 
 // Scene objects
 constexpr Sphere spheres[] = {
@@ -61,6 +122,9 @@ constexpr Sphere spheres[] = {
 
 constexpr Cube cube = { {0, -1, -10}, 2.0, water};
 
+// Checkerboard floor under the built-in scenes: height, x range and z range
+constexpr float floor_y = -3, floor_x[2] = { -12, 12 }, floor_z[2] = { -28, -12 };
+
 // Light positions
 constexpr vec3 lights[] = {
     {-15, 10, 25},
@@ -68,6 +132,969 @@ constexpr vec3 lights[] = {
     { 10, 10, 15}
 };
 
+// Axis-aligned bounding box
+struct AABB {
+    vec3 lo = { 1e30f, 1e30f, 1e30f };
+    vec3 hi = { -1e30f, -1e30f, -1e30f };
+    void expand(const vec3& p) {
+        lo = { std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z) };
+        hi = { std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z) };
+    }
+    void expand(const AABB& b) {
+        lo = { std::min(lo.x, b.lo.x), std::min(lo.y, b.lo.y), std::min(lo.z, b.lo.z) };
+        hi = { std::max(hi.x, b.hi.x), std::max(hi.y, b.hi.y), std::max(hi.z, b.hi.z) };
+    }
+    vec3 centroid() const { return (lo + hi) * .5f; }
+    float area() const {
+        vec3 e = hi - lo;
+        return e.x < 0 ? 0 : 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+// Ray with its reciprocal direction and per-axis direction sign (1 when negative), computed once and shared by every
+// slab test along the ray
+struct Ray {
+    vec3 orig, dir, inv_dir;
+    int sign[3] = {};
+
+    Ray() = default;
+    Ray(const vec3& o, const vec3& d) : orig(o), dir(d), inv_dir{ 1.f / d.x, 1.f / d.y, 1.f / d.z }, sign{ inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 } {}
+};
+
+// Slab test against a box, returns the entry distance or 1e30 on a miss
+float ray_aabb_intersect(const Ray& ray, const AABB& b, const float tmax) {
+    const vec3 &orig = ray.orig, &inv_dir = ray.inv_dir;
+    float tx0 = (b.lo.x - orig.x) * inv_dir.x, tx1 = (b.hi.x - orig.x) * inv_dir.x;
+    float ty0 = (b.lo.y - orig.y) * inv_dir.y, ty1 = (b.hi.y - orig.y) * inv_dir.y;
+    float tz0 = (b.lo.z - orig.z) * inv_dir.z, tz1 = (b.hi.z - orig.z) * inv_dir.z;
+    float tnear = std::max({ std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1), 0.f });
+    float tfar = std::min({ std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1), tmax });
+    return tnear <= tfar * 1.0000004f ? tnear : 1e30f; // conservative against rounding at box edges
+}
+
+// Scene data array that either owns its elements or views memory owned elsewhere, such as a mapped scene cache
+template <typename T>
+class SceneArray {
+public:
+    SceneArray() = default;
+    SceneArray(const SceneArray& o) : owned(o.owned), ptr(o.owns() ? owned.data() : o.ptr), count(o.count) {}
+    SceneArray(SceneArray&&) = default;
+    SceneArray& operator=(const SceneArray& o) { return *this = SceneArray(o); }
+    SceneArray& operator=(SceneArray&&) = default;
+
+    void push_back(const T& value) {
+        owned.push_back(value);
+        ptr = owned.data();
+        count = owned.size();
+    }
+    void assign(std::vector<T> values) {
+        owned = std::move(values);
+        ptr = owned.data();
+        count = owned.size();
+    }
+    // Points the array at external memory without copying; the caller keeps that memory alive
+    void view(const T* data, const size_t size) {
+        owned = std::vector<T>();
+        ptr = data;
+        count = size;
+    }
+    // Copies viewed memory into owned storage first, so mapped data can be updated in place (e.g. when animating)
+    T* mutable_data() {
+        if (!owns()) {
+            owned.assign(ptr, ptr + count);
+            ptr = owned.data();
+        }
+        return owned.data();
+    }
+    const T& operator[](const size_t i) const { return ptr[i]; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+private:
+    bool owns() const { return ptr == owned.data(); }
+
+    std::vector<T> owned;
+    const T* ptr = nullptr;
+    size_t count = 0;
+};
+
+// Primitive reference stored in the BVH leaves
+enum PrimitiveType { SPHERE, CUBE, MESH, TRIANGLE, PLANAR };
+
+struct Primitive {
+    PrimitiveType type;
+    int index;
+};
+
+// Flattened BVH node: leaves have count > 0 and own prims[first, first + count),
+// interior nodes have count == 0, the left child at this + 1 and the right child at first
+struct BVHNode {
+    AABB box;
+    int first = 0;
+    int count = 0;
+};
+
+// Bounding volume hierarchy built with the binned surface area heuristic
+struct BVH {
+    SceneArray<BVHNode> nodes;
+    SceneArray<Primitive> prims;
+    int depth = 0;
+
+    void build(const std::vector<Primitive>& primitives, const std::vector<AABB>& boxes) {
+        depth = 0;
+        std::vector<int> order(primitives.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = int(i);
+        staging.clear();
+        staging.reserve(2 * primitives.size());
+        if (!primitives.empty()) build_node(order, boxes, 0, int(order.size()), 1);
+        nodes.assign(std::move(staging));
+        staging = std::vector<BVHNode>();
+        std::vector<Primitive> sorted(primitives.size());
+        for (size_t i = 0; i < order.size(); i++) sorted[i] = primitives[order[i]];
+        prims.assign(std::move(sorted));
+    }
+
+    // Visits every leaf primitive whose node box the ray enters before tmax, nearest child first.
+    // The visitor may shrink tmax and returns true to stop the traversal early.
+    template <typename Visitor>
+    void traverse(const Ray& ray, const float& tmax, Visitor&& visit) const {
+        if (nodes.empty()) return;
+        int stack[64];
+        int sp = 0;
+        if (ray_aabb_intersect(ray, nodes[0].box, tmax) == 1e30f) return;
+        stack[sp++] = 0;
+        while (sp) {
+            const BVHNode& node = nodes[stack[--sp]];
+            if (node.count) {
+                for (int i = node.first; i < node.first + node.count; i++)
+                    if (visit(prims[i])) return;
+                continue;
+            }
+            int left = int(&node - nodes.data()) + 1, right = node.first;
+            float tl = ray_aabb_intersect(ray, nodes[left].box, tmax);
+            float tr = ray_aabb_intersect(ray, nodes[right].box, tmax);
+            if (tl > tr) { std::swap(tl, tr); std::swap(left, right); }
+            if (tr != 1e30f) stack[sp++] = right;
+            if (tl != 1e30f) stack[sp++] = left;
+        }
+    }
+
+    // Recomputes every node box bottom-up from the current primitive bounds, keeping the tree topology. Children are
+    // stored after their parent, so a reverse sweep always updates both children before the parent.
+    template <typename Bounds>
+    void refit(Bounds&& bounds) {
+        BVHNode* node = nodes.mutable_data();
+        for (size_t i = nodes.size(); i-- > 0;) {
+            AABB box;
+            if (node[i].count) {
+                for (int p = node[i].first; p < node[i].first + node[i].count; p++) box.expand(bounds(prims[p]));
+            } else {
+                box = node[i + 1].box;
+                box.expand(node[node[i].first].box);
+            }
+            node[i].box = box;
+        }
+    }
+
+private:
+    static constexpr int bins = 16;
+    static constexpr float traversal_cost = 1.f;
+    static constexpr float intersect_cost = 1.f;
+    std::vector<BVHNode> staging; // nodes under construction
+
+    int build_node(std::vector<int>& order, const std::vector<AABB>& boxes, int first, int count, int level) {
+        depth = std::max(depth, level);
+        int index = int(staging.size());
+        staging.emplace_back();
+        AABB box, centroids;
+        for (int i = first; i < first + count; i++) {
+            box.expand(boxes[order[i]]);
+            centroids.expand(boxes[order[i]].centroid());
+        }
+        staging[index].box = box;
+
+        // Evaluate binned SAH splits along every axis
+        int best_axis = -1, best_bin = 0;
+        float best_cost = intersect_cost * count;
+        for (int axis = 0; axis < 3 && count > 1; axis++) {
+            float extent = centroids.hi[axis] - centroids.lo[axis];
+            if (extent <= 0) continue;
+            AABB bin_box[bins];
+            int bin_count[bins] = {};
+            float scale = bins / extent;
+            for (int i = first; i < first + count; i++) {
+                int b = std::min(bins - 1, int((boxes[order[i]].centroid()[axis] - centroids.lo[axis]) * scale));
+                bin_box[b].expand(boxes[order[i]]);
+                bin_count[b]++;
+            }
+            float right_area[bins];
+            int right_count[bins];
+            AABB acc;
+            int n = 0;
+            for (int b = bins - 1; b > 0; b--) {
+                acc.expand(bin_box[b]);
+                n += bin_count[b];
+                right_area[b] = acc.area();
+                right_count[b] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 0; b < bins - 1; b++) {
+                acc.expand(bin_box[b]);
+                n += bin_count[b];
+                if (!n || !right_count[b + 1]) continue;
+                float cost = traversal_cost + intersect_cost * (acc.area() * n + right_area[b + 1] * right_count[b + 1]) / box.area();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        if (best_axis < 0) {
+            staging[index].first = first;
+            staging[index].count = count;
+            return index;
+        }
+
+        float scale = bins / (centroids.hi[best_axis] - centroids.lo[best_axis]);
+        int* mid = std::partition(order.data() + first, order.data() + first + count, [&](int i) {
+            return std::min(bins - 1, int((boxes[i].centroid()[best_axis] - centroids.lo[best_axis]) * scale)) <= best_bin;
+        });
+        int left_count = int(mid - (order.data() + first));
+        build_node(order, boxes, first, left_count, level + 1);
+        int right = build_node(order, boxes, first + left_count, count - left_count, level + 1);
+        staging[index].first = right;
+        return index;
+    }
+};
+
+// Structure-of-arrays sphere storage streamed by the intersection kernels
+struct SphereSoA {
+    SceneArray<float> center_x, center_y, center_z, radius;
+    SceneArray<int> material;
+
+    size_t size() const { return radius.size(); }
+    vec3 center(const int i) const { return { center_x[i], center_y[i], center_z[i] }; }
+    AABB bounds(const int i) const {
+        vec3 r = { radius[i], radius[i], radius[i] };
+        return { center(i) - r, center(i) + r };
+    }
+    void push_back(const vec3& c, const float r, const int m) {
+        center_x.push_back(c.x);
+        center_y.push_back(c.y);
+        center_z.push_back(c.z);
+        radius.push_back(r);
+        material.push_back(m);
+    }
+};
+
+// Orthonormal local axes of an oriented box, in world space
+struct Basis {
+    vec3 x = { 1, 0, 0 }, y = { 0, 1, 0 }, z = { 0, 0, 1 };
+};
+
+// Rotation by Euler angles in degrees, applied about x, then y, then z
+Basis euler_basis(const vec3& degrees) {
+    const float rx = degrees.x * .017453293f, ry = degrees.y * .017453293f, rz = degrees.z * .017453293f;
+    auto rotate = [&](vec3 v) {
+        v = { v.x, v.y * std::cos(rx) - v.z * std::sin(rx), v.y * std::sin(rx) + v.z * std::cos(rx) };
+        v = { v.x * std::cos(ry) + v.z * std::sin(ry), v.y, -v.x * std::sin(ry) + v.z * std::cos(ry) };
+        return vec3{ v.x * std::cos(rz) - v.y * std::sin(rz), v.x * std::sin(rz) + v.y * std::cos(rz), v.z };
+    };
+    return { rotate({ 1, 0, 0 }), rotate({ 0, 1, 0 }), rotate({ 0, 0, 1 }) };
+}
+
+// Structure-of-arrays box storage: cubes, non-uniform axis-aligned boxes and oriented boxes. rotation indexes the
+// shared bases table, or is -1 for an axis-aligned box.
+struct CubeSoA {
+    SceneArray<float> center_x, center_y, center_z, half_x, half_y, half_z;
+    SceneArray<int> material, rotation;
+    SceneArray<Basis> bases;
+
+    size_t count() const { return half_x.size(); }
+    vec3 center(const int i) const { return { center_x[i], center_y[i], center_z[i] }; }
+    vec3 half_size(const int i) const { return { half_x[i], half_y[i], half_z[i] }; }
+    AABB bounds(const int i) const {
+        vec3 h = half_size(i);
+        if (rotation[i] >= 0) {
+            const Basis& b = bases[rotation[i]];
+            h = { std::abs(b.x.x) * h.x + std::abs(b.y.x) * h.y + std::abs(b.z.x) * h.z,
+                  std::abs(b.x.y) * h.x + std::abs(b.y.y) * h.y + std::abs(b.z.y) * h.z,
+                  std::abs(b.x.z) * h.x + std::abs(b.y.z) * h.y + std::abs(b.z.z) * h.z };
+        }
+        return { center(i) - h, center(i) + h };
+    }
+    void push_back(const vec3& c, const vec3& half, const int m, const int r) {
+        center_x.push_back(c.x);
+        center_y.push_back(c.y);
+        center_z.push_back(c.z);
+        half_x.push_back(half.x);
+        half_y.push_back(half.y);
+        half_z.push_back(half.z);
+        material.push_back(m);
+        rotation.push_back(r);
+    }
+    int add_basis(const Basis& b) {
+        bases.push_back(b);
+        return int(bases.size()) - 1;
+    }
+};
+
+bool same_material(const Material& a, const Material& b) {
+    return a.refractive_index == b.refractive_index && std::equal(a.albedo, a.albedo + 4, b.albedo) && a.diffuse_color.x == b.diffuse_color.x &&
+           a.diffuse_color.y == b.diffuse_color.y && a.diffuse_color.z == b.diffuse_color.z && a.specular_exponent == b.specular_exponent && a.texture == b.texture;
+}
+
+// Point light
+struct Light {
+    vec3 position;
+    float intensity = 1;
+};
+
+// Lower bound on the cone term of light tree importance, so lights behind the surface keep a nonzero probability
+constexpr float light_cone_floor = .05f;
+
+// Binary tree over the point lights for stochastic light selection; each node holds its lights' bounds and intensity
+struct LightTree {
+    struct Node {
+        AABB box;
+        float power = 0;
+        int left = -1, right = -1; // children, or the light index in left for a leaf (right < 0)
+    };
+    std::vector<Node> nodes;
+
+    void build(const std::vector<Light>& lights) {
+        nodes.clear();
+        if (lights.empty()) return;
+        std::vector<int> order(lights.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = int(i);
+        nodes.reserve(2 * lights.size() - 1);
+        build_node(lights, order.data(), int(order.size()));
+    }
+
+    // Node intensity scaled by the cosine between N and the nearest direction into the cone its box subtends from point
+    float importance(const Node& node, const vec3& point, const vec3& N) const {
+        vec3 to = (node.box.lo + node.box.hi) * .5f - point;
+        float radius = (node.box.hi - node.box.lo).norm() * .5f, dist = to.norm();
+        if (dist <= radius) return node.power;
+        float cos_theta = to * N / dist, sin_theta = std::sqrt(std::max(0.f, 1 - cos_theta * cos_theta));
+        float sin_cone = radius / dist, cos_cone = std::sqrt(1 - sin_cone * sin_cone);
+        float cos_bound = cos_theta >= cos_cone ? 1 : cos_theta * cos_cone + sin_theta * sin_cone;
+        return node.power * std::max(light_cone_floor, cos_bound);
+    }
+
+    // Picks a light with probability pdf, choosing each child in proportion to its importance
+    int sample(const vec3& point, const vec3& N, float u, float& pdf) const {
+        assert(!nodes.empty());
+        pdf = 1;
+        int n = 0;
+        while (nodes[n].right >= 0) {
+            float left = importance(nodes[nodes[n].left], point, N), right = importance(nodes[nodes[n].right], point, N);
+            float p = left + right > 0 ? left / (left + right) : .5f;
+            if (u < p) {
+                u /= p;
+                pdf *= p;
+                n = nodes[n].left;
+            } else {
+                u = std::min((u - p) / (1 - p), .99999994f);
+                pdf *= 1 - p;
+                n = nodes[n].right;
+            }
+        }
+        return nodes[n].left;
+    }
+
+private:
+    // Median split along the longest axis of the light positions; returns the node index
+    int build_node(const std::vector<Light>& lights, int* first, const int count) {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+        Node node;
+        for (int i = 0; i < count; i++) {
+            node.box.expand(lights[first[i]].position);
+            node.power += lights[first[i]].intensity;
+        }
+        if (count == 1) {
+            node.left = first[0];
+        } else {
+            vec3 extent = node.box.hi - node.box.lo;
+            int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+            int half = count / 2;
+            std::nth_element(first, first + half, first + count, [&](const int a, const int b) { return lights[a].position[axis] < lights[b].position[axis]; });
+            node.left = build_node(lights, first, half);
+            node.right = build_node(lights, first + half, count - half);
+        }
+        nodes[index] = node;
+        return index;
+    }
+};
+
+// Flat primitives: an infinite plane through center, or a disc or rectangle centred on it
+enum PlanarShape { PLANE_INFINITE, PLANE_DISC, PLANE_RECT };
+
+// u and v span the surface; a rectangle extends half_u and half_v along them, a disc has radius half_u
+struct Planar {
+    PlanarShape shape = PLANE_INFINITE;
+    vec3 center, normal = { 0, 1, 0 }, u = { 1, 0, 0 }, v = { 0, 0, -1 };
+    float half_u = 0, half_v = 0;
+    int material = 0;
+
+    Planar() = default;
+    // u runs horizontally (along x for floors and ceilings) and v completes the frame with the normal
+    Planar(const PlanarShape shape, const vec3& center, const vec3& normal, const float half_u, const float half_v, const int material)
+        : shape(shape), center(center), normal(normal.normalized()), half_u(half_u), half_v(half_v), material(material) {
+        const vec3 n = this->normal;
+        u = std::abs(n.y) > .999f ? (vec3{ 1, 0, 0 } - n * n.x).normalized() : cross({ 0, 1, 0 }, n).normalized();
+        v = cross(n, u);
+    }
+
+    // Box around a disc or rectangle, padded so the BVH never sees a zero-thickness slab
+    AABB bounds() const {
+        vec3 extent;
+        for (int k = 0; k < 3; k++) {
+            extent[k] = shape == PLANE_DISC ? half_u * std::sqrt(std::max(0.f, 1 - normal[k] * normal[k]))
+                                            : std::abs(u[k]) * half_u + std::abs(v[k]) * half_v;
+            extent[k] += .001f;
+        }
+        AABB box;
+        box.expand(center - extent);
+        box.expand(center + extent);
+        return box;
+    }
+};
+
+// The legacy checkerboard floor: the rectangle at height y spanning x_min < x < x_max and z_min < z < z_max
+Planar floor_rect(const float y, const float x_min, const float x_max, const float z_min, const float z_max, const int material) {
+    return Planar(PLANE_RECT, { (x_min + x_max) * .5f, y, (z_min + z_max) * .5f }, { 0, 1, 0 }, (x_max - x_min) * .5f, (z_max - z_min) * .5f, material);
+}
+
+// Textures replace a material's diffuse colour and are only evaluated when shading the winning hit. Checker and image
+// textures read the hit's surface coordinates (u, v); marble is a solid texture read at the hit point itself.
+enum TextureKind { TEXTURE_CHECKER, TEXTURE_MARBLE, TEXTURE_IMAGE };
+
+// Defaults to the two-unit checkerboard of the built-in floor
+struct Texture {
+    TextureKind kind = TEXTURE_CHECKER;
+    vec3 color_a = { .4, .4, .4 }, color_b = { .4, .3, .2 }; // odd and even cells, or veins and base
+    float scale = 2; // checker cell size, marble stripe period, or surface units per image repeat
+    float turbulence = 0; // marble vein distortion
+    int image = -1; // index into Scene::images
+};
+
+// Gradient noise after Perlin's improved noise, with the permutation table replaced by an integer hash of the lattice
+// point; roughly in [-1, 1]
+float gradient_noise(const vec3& p) {
+    const float fx = std::floor(p.x), fy = std::floor(p.y), fz = std::floor(p.z);
+    const int x = int(fx), y = int(fy), z = int(fz);
+    const float dx = p.x - fx, dy = p.y - fy, dz = p.z - fz;
+    auto grad = [](const int i, const int j, const int k, const float gx, const float gy, const float gz) {
+        uint32_t h = uint32_t(i) * 73856093u ^ uint32_t(j) * 19349663u ^ uint32_t(k) * 83492791u;
+        h = (h ^ (h >> 13)) * 0x5bd1e995u;
+        h = (h ^ (h >> 15)) & 15;
+        float u = h < 8 ? gx : gy, v = h < 4 ? gy : h == 12 || h == 14 ? gx : gz;
+        return (h & 1 ? -u : u) + (h & 2 ? -v : v);
+    };
+    auto fade = [](const float t) { return t * t * t * (t * (t * 6 - 15) + 10); };
+    auto lerp = [](const float t, const float a, const float b) { return a + t * (b - a); };
+    const float u = fade(dx), v = fade(dy), w = fade(dz);
+    return lerp(w, lerp(v, lerp(u, grad(x, y, z, dx, dy, dz), grad(x + 1, y, z, dx - 1, dy, dz)),
+                           lerp(u, grad(x, y + 1, z, dx, dy - 1, dz), grad(x + 1, y + 1, z, dx - 1, dy - 1, dz))),
+                   lerp(v, lerp(u, grad(x, y, z + 1, dx, dy, dz - 1), grad(x + 1, y, z + 1, dx - 1, dy, dz - 1)),
+                           lerp(u, grad(x, y + 1, z + 1, dx, dy - 1, dz - 1), grad(x + 1, y + 1, z + 1, dx - 1, dy - 1, dz - 1))));
+}
+
+// Sum of six octaves of |noise|, each at twice the frequency and half the weight of the previous
+float turbulence(vec3 p) {
+    float sum = 0, weight = 1;
+    for (int octave = 0; octave < 6; octave++, weight *= .5f, p = p * 2.f) sum += weight * std::abs(gradient_noise(p));
+    return sum;
+}
+
+// Image texture read lazily from a binary PPM: only the header is read when the scene loads, texels are fetched through
+// the tile cache one tile of one mip level at a time
+struct TextureImage {
+    std::string path;
+    uint64_t id = 0; // unique for the lifetime of the process, part of the tile cache key
+    int width = 0, height = 0, levels = 1;
+    std::streamoff data_offset = 0;
+    std::ifstream file;
+    std::mutex file_lock;
+
+    int level_width(const int level) const { return std::max(1, width >> level); }
+    int level_height(const int level) const { return std::max(1, height >> level); }
+
+    static std::shared_ptr<TextureImage> open(const std::string& path) {
+        static std::atomic<uint64_t> next_id{ 0 };
+        auto image = std::make_shared<TextureImage>();
+        image->path = path;
+        image->file.open(path, std::ifstream::in | std::ifstream::binary);
+        std::string magic;
+        int max_value = 0;
+        image->file >> magic >> image->width >> image->height >> max_value;
+        image->file.get(); // the single whitespace byte before the texels
+        image->data_offset = image->file.tellg();
+        image->file.seekg(0, std::ios::end);
+        std::streamoff size = image->file.tellg();
+        if (!image->file || magic != "P6" || max_value != 255 || image->width <= 0 || image->height <= 0 ||
+            size - image->data_offset < std::streamoff(image->width) * image->height * 3) {
+            std::cerr << path << ": image textures must be binary PPM (P6) files with 8-bit channels\n";
+            return nullptr;
+        }
+        while (image->level_width(image->levels - 1) > 1 || image->level_height(image->levels - 1) > 1) image->levels++;
+        image->id = next_id++;
+        return image;
+    }
+};
+
+// Square block of 8-bit RGB texels, the unit of texture caching
+constexpr int texture_tile_size = 32;
+
+struct TextureTile {
+    uint8_t texels[texture_tile_size * texture_tile_size * 3] = {};
+};
+
+// Bounded LRU cache of texture tiles shared by all threads; coarse mip tiles are averaged from finer ones on demand
+class TextureCache {
+public:
+    size_t budget = size_t(64) << 20;
+    std::atomic<uint64_t> loaded{ 0 }, evicted{ 0 };
+
+    vec3 texel(TextureImage& image, const int level, const int x, const int y) {
+        const int tx = x / texture_tile_size, ty = y / texture_tile_size;
+        const uint64_t key = tile_key(image, level, tx, ty);
+        // A few recently used tiles per thread skip the shared lock for coherent lookups
+        thread_local std::pair<uint64_t, std::shared_ptr<const TextureTile>> recent[4];
+        auto& slot = recent[(tx & 1) | (ty & 1) << 1];
+        if (slot.first != key || !slot.second) slot = { key, tile(image, level, tx, ty) };
+        const uint8_t* t = slot.second->texels + 3 * ((y % texture_tile_size) * texture_tile_size + x % texture_tile_size);
+        return vec3{ float(t[0]), float(t[1]), float(t[2]) } * (1.f / 255);
+    }
+
+    size_t resident_bytes() {
+        std::lock_guard<std::mutex> guard(lock);
+        return bytes;
+    }
+
+private:
+    std::mutex lock;
+    std::list<uint64_t> lru; // most recently used first
+    std::unordered_map<uint64_t, std::pair<std::shared_ptr<const TextureTile>, std::list<uint64_t>::iterator>> tiles;
+    size_t bytes = 0;
+
+    static uint64_t tile_key(const TextureImage& image, const int level, const int tx, const int ty) {
+        return image.id << 40 | uint64_t(level) << 34 | uint64_t(ty) << 17 | uint64_t(tx);
+    }
+
+    std::shared_ptr<const TextureTile> tile(TextureImage& image, const int level, const int tx, const int ty) {
+        const uint64_t key = tile_key(image, level, tx, ty);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = tiles.find(key);
+            if (it != tiles.end()) {
+                lru.splice(lru.begin(), lru, it->second.second);
+                return it->second.first;
+            }
+        }
+        // Built without holding the lock: coarser levels look up the tiles of the level below
+        auto built = std::make_shared<TextureTile>();
+        const int x0 = tx * texture_tile_size, y0 = ty * texture_tile_size;
+        const int w = std::min(texture_tile_size, image.level_width(level) - x0), h = std::min(texture_tile_size, image.level_height(level) - y0);
+        if (level == 0) {
+            std::lock_guard<std::mutex> guard(image.file_lock);
+            for (int y = 0; y < h; y++) {
+                image.file.seekg(image.data_offset + (std::streamoff(y0 + y) * image.width + x0) * 3);
+                image.file.read(reinterpret_cast<char*>(built->texels + 3 * y * texture_tile_size), std::streamsize(3 * w));
+            }
+            image.file.clear();
+        } else {
+            // The texels below this tile lie in up to 2x2 tiles of the finer level, held here so that eviction cannot
+            // drop one of them halfway through and make the build recurse again
+            const int below_w = image.level_width(level - 1), below_h = image.level_height(level - 1);
+            std::shared_ptr<const TextureTile> below[2][2];
+            for (int j = 0; j < 2; j++)
+                for (int i = 0; i < 2; i++)
+                    if ((2 * tx + i) * texture_tile_size < below_w && (2 * ty + j) * texture_tile_size < below_h)
+                        below[j][i] = tile(image, level - 1, 2 * tx + i, 2 * ty + j);
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    int sum[3] = {};
+                    for (int j = 0; j < 2; j++) {
+                        for (int i = 0; i < 2; i++) {
+                            const int bx = std::min(2 * (x0 + x) + i, below_w - 1) - 2 * x0, by = std::min(2 * (y0 + y) + j, below_h - 1) - 2 * y0;
+                            const uint8_t* b = below[by / texture_tile_size][bx / texture_tile_size]->texels +
+                                               3 * ((by % texture_tile_size) * texture_tile_size + bx % texture_tile_size);
+                            for (int c = 0; c < 3; c++) sum[c] += b[c];
+                        }
+                    }
+                    uint8_t* t = built->texels + 3 * (y * texture_tile_size + x);
+                    for (int c = 0; c < 3; c++) t[c] = uint8_t((sum[c] + 2) / 4);
+                }
+            }
+        }
+        loaded++;
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto [it, inserted] = tiles.try_emplace(key);
+        if (!inserted) return it->second.first; // another thread built it meanwhile
+        lru.push_front(key);
+        it->second = { std::move(built), lru.begin() };
+        bytes += sizeof(TextureTile);
+        while (bytes > budget && lru.size() > 1) {
+            tiles.erase(lru.back());
+            lru.pop_back();
+            bytes -= sizeof(TextureTile);
+            evicted++;
+        }
+        return it->second.first;
+    }
+};
+
+TextureCache texture_cache;
+
+// Bilinear lookup at a mip level chosen from the footprint, the size of the shaded area in texels of level 0.
+// Coordinates repeat, and v runs up the image.
+vec3 sample_image(TextureImage& image, const float u, const float v, const float footprint) {
+    const int level = std::min(image.levels - 1, int(std::log2(std::max(footprint, 1.f)) + .5f));
+    const int w = image.level_width(level), h = image.level_height(level);
+    const float x = (u - std::floor(u)) * w - .5f, y = (1 - (v - std::floor(v))) * h - .5f;
+    const float fx = std::floor(x), fy = std::floor(y), ax = x - fx, ay = y - fy;
+    auto at = [&](const int i, const int j) { return texture_cache.texel(image, level, (i % w + w) % w, (j % h + h) % h); };
+    const int x0 = int(fx), y0 = int(fy);
+    return (at(x0, y0) * (1 - ax) + at(x0 + 1, y0) * ax) * (1 - ay) + (at(x0, y0 + 1) * (1 - ax) + at(x0 + 1, y0 + 1) * ax) * ay;
+}
+
+// Pinhole or thin-lens camera (fov vertical, in radians); set_image precomputes the basis for pixel rays
+struct Camera {
+    vec3 position = { 0, 0, 0 };
+    vec3 look_at = { 0, 0, -1 };
+    vec3 up = { 0, 1, 0 };
+    float fov = 1.05;
+    float aperture = 0;
+    float focus_distance = 0;
+    float aspect = 1;
+    vec3 corner, right, down;
+    vec3 lens_x, lens_y; // lens radius along the image axes
+    float focus_scale = 0; // scales a pinhole direction to its point on the focal plane
+    float pixel_angle = 0; // angle subtended by one pixel, for texture filtering
+
+    void set_image(const int width, const int height) {
+        aspect = float(width) / height;
+        vec3 forward = (look_at - position).normalized();
+        vec3 side = cross(forward, up);
+        if (side.norm() < 1e-6f) side = cross(forward, vec3{ 0, 0, -1 }); // looking straight up or down
+        side = side.normalized();
+        // The image plane sits at the focal distance in pixel units, so one pixel step is a unit basis vector
+        const float focal = float(height / (2. * std::tan(fov / 2.)));
+        right = side;
+        down = cross(forward, side);
+        corner = forward * focal - right * (width / 2.f) - down * (height / 2.f);
+        lens_x = right * (aperture / 2);
+        lens_y = down * (-aperture / 2);
+        focus_scale = (focus_distance > 0 ? focus_distance : (look_at - position) * forward) / focal;
+        pixel_angle = 1 / focal;
+    }
+
+    vec3 direction(const float x, const float y) const {
+        return (corner + right * x + down * y).normalized();
+    }
+
+    // Ray through image position (x, y) from lens position (u, v) in [0, 1)^2. The square is mapped to the lens disk
+    // with Shirley's concentric mapping, which keeps stratified samples stratified.
+    void lens_ray(const float x, const float y, const float u, const float v, vec3& orig, vec3& dir) const {
+        vec3 pinhole = corner + right * x + down * y;
+        float a = 2 * u - 1, b = 2 * v - 1, r = 0, phi = 0;
+        if (std::abs(a) > std::abs(b)) { r = a; phi = .7853982f * (b / a); }
+        else if (b != 0) { r = b; phi = 1.5707963f - .7853982f * (a / b); }
+        vec3 offset = lens_x * (r * std::cos(phi)) + lens_y * (r * std::sin(phi));
+        orig = position + offset;
+        dir = (pinhole * focus_scale - offset).normalized();
+    }
+
+    // Unit directions through (x0 + i, y) for i in [0, count), written as SoA lanes. The row origin is computed once and
+    // each lane only adds a multiple of the column increment, so the loop vectorises.
+    void row_directions(const float x0, const float y, const int count, float* dx, float* dy, float* dz) const {
+        const vec3 row = corner + down * y + right * x0;
+        for (int i = 0; i < count; i++) {
+            float x = row.x + right.x * i, yy = row.y + right.y * i, z = row.z + right.z * i;
+            float inv_norm = 1.f / std::sqrt(x * x + yy * yy + z * z);
+            dx[i] = x * inv_norm;
+            dy[i] = yy * inv_norm;
+            dz[i] = z * inv_norm;
+        }
+    }
+};
+
+// Mesh BVH node with its box quantised to 16 bits per axis of the mesh bounds, rounded outwards; laid out as BVHNode
+struct QuantizedNode {
+    uint16_t lo[3], hi[3];
+    uint32_t first;
+    uint32_t count;
+};
+
+// Indexed triangle mesh with its own BVH. Triangles are reordered into leaf order by build(). Winding is
+// counter-clockwise seen from outside, as in OBJ files, which fixes the direction of the geometric normal.
+struct Mesh {
+    std::vector<vec3> vertices;
+    std::vector<uint32_t> indices; // three per triangle
+    std::vector<QuantizedNode> nodes;
+    AABB bounds;
+    vec3 grid_origin, grid_step;
+    int material = 0;
+    int depth = 0;
+
+    size_t triangle_count() const { return indices.size() / 3; }
+    const vec3& vertex(const size_t triangle, const int corner) const { return vertices[indices[3 * triangle + corner]]; }
+
+    void build() {
+        std::vector<Primitive> prims(triangle_count());
+        std::vector<AABB> boxes(prims.size());
+        bounds = AABB();
+        for (size_t t = 0; t < prims.size(); t++) {
+            prims[t] = { TRIANGLE, int(t) };
+            for (int c = 0; c < 3; c++) boxes[t].expand(vertex(t, c));
+            bounds.expand(boxes[t]);
+        }
+        BVH bvh;
+        bvh.build(prims, boxes);
+        depth = bvh.depth;
+
+        std::vector<uint32_t> sorted(indices.size());
+        for (size_t i = 0; i < bvh.prims.size(); i++)
+            for (int c = 0; c < 3; c++) sorted[3 * i + c] = indices[3 * size_t(bvh.prims[i].index) + c];
+        indices = std::move(sorted);
+
+        grid_origin = bounds.lo;
+        for (int a = 0; a < 3; a++) grid_step[a] = std::max((bounds.hi[a] - bounds.lo[a]) / 65533.f, 1e-30f);
+        nodes.resize(bvh.nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const BVHNode& node = bvh.nodes[i];
+            for (int a = 0; a < 3; a++) {
+                // One grid step of slack on each side absorbs rounding when the box is expanded again
+                float lo = std::floor((node.box.lo[a] - grid_origin[a]) / grid_step[a]) - 1;
+                float hi = std::ceil((node.box.hi[a] - grid_origin[a]) / grid_step[a]) + 1;
+                nodes[i].lo[a] = uint16_t(std::max(0.f, lo));
+                nodes[i].hi[a] = uint16_t(std::min(65535.f, hi));
+            }
+            nodes[i].first = uint32_t(node.first);
+            nodes[i].count = uint32_t(node.count);
+        }
+    }
+
+    AABB node_box(const QuantizedNode& node) const {
+        AABB box;
+        for (int a = 0; a < 3; a++) {
+            box.lo[a] = grid_origin[a] + node.lo[a] * grid_step[a];
+            box.hi[a] = grid_origin[a] + node.hi[a] * grid_step[a];
+        }
+        return box;
+    }
+
+    vec3 normal(const int triangle) const {
+        return cross(vertex(triangle, 1) - vertex(triangle, 0), vertex(triangle, 2) - vertex(triangle, 0)).normalized();
+    }
+
+    // Moller-Trumbore over the mesh BVH: shrinks tmax to the nearest hit, setting triangle and barycentric if given
+    template <bool any_hit = false>
+    bool intersect(const Ray& ray, float& tmax, int& triangle, float* barycentric = nullptr) const {
+        if (nodes.empty() || ray_aabb_intersect(ray, node_box(nodes[0]), tmax) == 1e30f) return false;
+        bool hit = false;
+        uint32_t stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+            const QuantizedNode& node = nodes[stack[--sp]];
+            if (node.count) {
+                for (uint32_t t = node.first; t < node.first + node.count; t++) {
+                    const vec3& v0 = vertex(t, 0);
+                    vec3 e1 = vertex(t, 1) - v0, e2 = vertex(t, 2) - v0;
+                    vec3 p = cross(ray.dir, e2);
+                    float det = e1 * p;
+                    if (std::abs(det) < 1e-12f) continue;
+                    float inv_det = 1 / det;
+                    vec3 s = ray.orig - v0;
+                    float u = (s * p) * inv_det;
+                    if (u < 0 || u > 1) continue;
+                    vec3 q = cross(s, e1);
+                    float v = (ray.dir * q) * inv_det;
+                    if (v < 0 || u + v > 1) continue;
+                    float d = (e2 * q) * inv_det;
+                    if (d <= .001f || d >= tmax) continue;
+                    tmax = d;
+                    triangle = int(t);
+                    if (barycentric) { barycentric[0] = u; barycentric[1] = v; }
+                    hit = true;
+                    if (any_hit) return true;
+                }
+                continue;
+            }
+            uint32_t left = uint32_t(&node - nodes.data()) + 1, right = node.first;
+            float tl = ray_aabb_intersect(ray, node_box(nodes[left]), tmax);
+            float tr = ray_aabb_intersect(ray, node_box(nodes[right]), tmax);
+            if (tl > tr) { std::swap(tl, tr); std::swap(left, right); }
+            if (tr != 1e30f) stack[sp++] = right;
+            if (tl != 1e30f) stack[sp++] = left;
+        }
+        return hit;
+    }
+};
+
+// Animated object kinds; tracks address spheres, cubes and lights by their declaration order in the scene
+enum AnimatedKind { ANIMATED_SPHERE, ANIMATED_CUBE, ANIMATED_LIGHT, ANIMATED_CAMERA };
+
+// Position at a frame; camera keys also carry the look-at point
+struct Keyframe {
+    float frame;
+    vec3 position, look_at;
+};
+
+// Keyframes of one object, sorted by frame
+struct Track {
+    AnimatedKind kind;
+    int index;
+    std::vector<Keyframe> keys;
+
+    void insert(const Keyframe& key) {
+        auto it = std::upper_bound(keys.begin(), keys.end(), key.frame, [](const float f, const Keyframe& k) { return f < k.frame; });
+        keys.insert(it, key);
+    }
+
+    // Linear interpolation between the surrounding keys, holding the first and last key outside their range
+    Keyframe at(const float frame) const {
+        if (frame <= keys.front().frame) return keys.front();
+        if (frame >= keys.back().frame) return keys.back();
+        size_t i = 1;
+        while (keys[i].frame < frame) i++;
+        const Keyframe &a = keys[i - 1], &b = keys[i];
+        float t = (frame - a.frame) / (b.frame - a.frame);
+        return { frame, a.position + (b.position - a.position) * t, a.look_at + (b.look_at - a.look_at) * t };
+    }
+};
+
+// Runtime scene storage traversed by scene_intersect: geometry lives in SoA arrays indexing a shared material table
+struct Scene {
+    std::vector<Material> materials;
+    SphereSoA spheres;
+    CubeSoA cubes;
+    std::vector<Mesh> meshes;
+    BVH bvh;
+    std::vector<Light> lights;
+    LightTree light_tree;
+    std::vector<Planar> planars;
+    std::vector<Texture> textures;
+    std::vector<std::shared_ptr<TextureImage>> images;
+    std::vector<Primitive> unbounded; // infinite planes, tested by every ray outside the BVH
+    vec3 background = { 0.2, 0.7, 0.8 };
+    Camera camera;
+    std::vector<Track> tracks;
+    std::vector<int> sphere_slots, cube_slots; // declaration index -> index in the leaf-ordered arrays
+    std::shared_ptr<const void> backing; // keeps a mapped scene cache alive while arrays view into it
+
+    int add_material(const Material& m) {
+        for (size_t i = 0; i < materials.size(); i++)
+            if (same_material(materials[i], m)) return int(i);
+        materials.push_back(m);
+        return int(materials.size()) - 1;
+    }
+    // Copy of a material with its diffuse colour replaced by a new texture
+    int add_textured(Material m, const Texture& t) {
+        textures.push_back(t);
+        m.texture = int(textures.size()) - 1;
+        return add_material(m);
+    }
+    void add(const Sphere& s) { spheres.push_back(s.center, s.radius, add_material(s.material)); }
+    void add(const Cube& c) { cubes.push_back(c.center, vec3{ c.size, c.size, c.size } * .5f, add_material(c.material), -1); }
+
+    void build_bvh() {
+        std::vector<Primitive> prims;
+        std::vector<AABB> boxes;
+        for (size_t i = 0; i < spheres.size(); i++) {
+            prims.push_back({ SPHERE, int(i) });
+            boxes.push_back(spheres.bounds(int(i)));
+        }
+        for (size_t i = 0; i < cubes.count(); i++) {
+            prims.push_back({ CUBE, int(i) });
+            boxes.push_back(cubes.bounds(int(i)));
+        }
+        for (size_t i = 0; i < meshes.size(); i++) {
+            meshes[i].build();
+            prims.push_back({ MESH, int(i) });
+            boxes.push_back(meshes[i].bounds);
+        }
+        for (size_t i = 0; i < planars.size(); i++) {
+            if (planars[i].shape == PLANE_INFINITE) continue;
+            prims.push_back({ PLANAR, int(i) });
+            boxes.push_back(planars[i].bounds());
+        }
+        bvh.build(prims, boxes);
+        reorder_to_leaves();
+        collect_unbounded();
+    }
+
+    void collect_unbounded() {
+        unbounded.clear();
+        for (size_t i = 0; i < planars.size(); i++)
+            if (planars[i].shape == PLANE_INFINITE) unbounded.push_back({ PLANAR, int(i) });
+    }
+
+    // Moves every animated object to its position at the given frame and refits the BVH to the new bounds
+    void set_frame(const float frame) {
+        if (tracks.empty()) return;
+        for (const Track& track : tracks) {
+            Keyframe key = track.at(frame);
+            if (track.kind == ANIMATED_SPHERE) {
+                int i = sphere_slots.empty() ? track.index : sphere_slots[track.index];
+                spheres.center_x.mutable_data()[i] = key.position.x;
+                spheres.center_y.mutable_data()[i] = key.position.y;
+                spheres.center_z.mutable_data()[i] = key.position.z;
+            } else if (track.kind == ANIMATED_CUBE) {
+                int i = cube_slots.empty() ? track.index : cube_slots[track.index];
+                cubes.center_x.mutable_data()[i] = key.position.x;
+                cubes.center_y.mutable_data()[i] = key.position.y;
+                cubes.center_z.mutable_data()[i] = key.position.z;
+            } else if (track.kind == ANIMATED_LIGHT) {
+                lights[track.index].position = key.position;
+            } else {
+                camera.position = key.position;
+                camera.look_at = key.look_at;
+            }
+        }
+        bvh.refit([&](const Primitive& p) {
+            return p.type == SPHERE ? spheres.bounds(p.index) : p.type == CUBE ? cubes.bounds(p.index) : p.type == PLANAR ? planars[p.index].bounds() : meshes[p.index].bounds;
+        });
+        light_tree.build(lights);
+    }
+
+private:
+    // Permutes the SoA arrays into BVH leaf order so every leaf streams over contiguous memory
+    void reorder_to_leaves() {
+        SphereSoA sorted_spheres;
+        CubeSoA sorted_cubes;
+        sorted_cubes.bases = cubes.bases;
+        std::vector<Primitive> prims(bvh.prims.begin(), bvh.prims.end());
+        sphere_slots.assign(spheres.size(), 0);
+        cube_slots.assign(cubes.count(), 0);
+        for (Primitive& p : prims) {
+            if (p.type == SPHERE) {
+                sorted_spheres.push_back(spheres.center(p.index), spheres.radius[p.index], spheres.material[p.index]);
+                p.index = sphere_slots[p.index] = int(sorted_spheres.size()) - 1;
+            } else if (p.type == CUBE) {
+                sorted_cubes.push_back(cubes.center(p.index), cubes.half_size(p.index), cubes.material[p.index], cubes.rotation[p.index]);
+                p.index = cube_slots[p.index] = int(sorted_cubes.count()) - 1;
+            }
+        }
+        spheres = std::move(sorted_spheres);
+        cubes = std::move(sorted_cubes);
+        bvh.prims.assign(std::move(prims));
+    }
+};
+
+Scene scene;
+
 // Reflect and refract functions
 vec3 reflect(const vec3& I, const vec3& N) {
     return I - N * 2.f * (I * N);
@@ -82,141 +1109,2259 @@ vec3 refract(const vec3& I, const vec3& N, const float eta_t, const float eta_i
 }
 
 // Ray-sphere intersection
-std::tuple<bool, float> ray_sphere_intersect(const vec3& orig, const vec3& dir, const Sphere& s) {
-    vec3 L = s.center - orig;
+std::tuple<bool, float> ray_sphere_intersect(const vec3& orig, const vec3& dir, const vec3& center, const float radius) {
+    vec3 L = center - orig;
     float tca = L * dir;
     float d2 = L * L - tca * tca;
-    if (d2 > s.radius * s.radius) return { false, 0 };
-    float thc = std::sqrt(s.radius * s.radius - d2);
+    if (d2 > radius * radius) return { false, 0 };
+    float thc = std::sqrt(radius * radius - d2);
     float t0 = tca - thc, t1 = tca + thc;
     if (t0 > .001) return { true, t0 };
     if (t1 > .001) return { true, t1 };
     return { false, 0 };
 }
 
-// Ray-cube intersection
-std::tuple<bool, float, vec3> ray_cube_intersect(const vec3& orig, const vec3& dir, const Cube& c) {
-    float tmin = (c.center.x - c.size / 2 - orig.x) / dir.x;
-    float tmax = (c.center.x + c.size / 2 - orig.x) / dir.x;
-    if (tmin > tmax) std::swap(tmin, tmax);
+// Branch-free slab test: the ray's sign bits pick the near and far plane on each axis. Returns the entry distance and the
+// entered face (2 * axis, plus 1 for the positive side); boxes containing the ray origin or behind it are missed.
+std::tuple<bool, float, int> ray_slab_intersect(const Ray& ray, const vec3& lo, const vec3& hi) {
+    const vec3 bounds[2] = { lo, hi };
+    float tx0 = (bounds[ray.sign[0]].x - ray.orig.x) * ray.inv_dir.x, tx1 = (bounds[1 - ray.sign[0]].x - ray.orig.x) * ray.inv_dir.x;
+    float ty0 = (bounds[ray.sign[1]].y - ray.orig.y) * ray.inv_dir.y, ty1 = (bounds[1 - ray.sign[1]].y - ray.orig.y) * ray.inv_dir.y;
+    float tz0 = (bounds[ray.sign[2]].z - ray.orig.z) * ray.inv_dir.z, tz1 = (bounds[1 - ray.sign[2]].z - ray.orig.z) * ray.inv_dir.z;
+    float tnear = std::max(tx0, std::max(ty0, tz0)), tfar = std::min(tx1, std::min(ty1, tz1));
+    int axis = tx0 >= ty0 ? (tx0 >= tz0 ? 0 : 2) : (ty0 >= tz0 ? 1 : 2);
+    return { tnear > .001f && tnear <= tfar, tnear, 2 * axis + ray.sign[axis] };
+}
+
+// Outward normal of a slab face index, in the box's local axes
+vec3 face_normal(const int face) {
+    vec3 N;
+    N[face / 2] = face & 1 ? 1.f : -1.f;
+    return N;
+}
+
+// Ray-box intersection: hit, distance and outward normal. Axis-aligned boxes reuse the ray's reciprocal direction;
+// oriented boxes are tested in their local frame, where they are axis-aligned.
+std::tuple<bool, float, vec3> ray_cube_intersect(const Ray& ray, const CubeSoA& cubes, const int i) {
+    const vec3 center = cubes.center(i), half = cubes.half_size(i);
+    if (cubes.rotation[i] < 0) {
+        auto [hit, t, face] = ray_slab_intersect(ray, center - half, center + half);
+        return { hit, t, face_normal(face) };
+    }
+    const Basis& b = cubes.bases[cubes.rotation[i]];
+    const vec3 o = ray.orig - center;
+    Ray local({ o * b.x, o * b.y, o * b.z }, { ray.dir * b.x, ray.dir * b.y, ray.dir * b.z });
+    auto [hit, t, face] = ray_slab_intersect(local, -half, half);
+    const vec3& axis = face / 2 == 0 ? b.x : face / 2 == 1 ? b.y : b.z;
+    return { hit, t, face & 1 ? axis : -axis };
+}
+
+// Ray-plane intersection clipped to the disc or rectangle; rays grazing the surface (|dir . normal| <= .001) miss
+std::tuple<bool, float> ray_planar_intersect(const vec3& orig, const vec3& dir, const Planar& planar) {
+    float facing = dir * planar.normal;
+    if (std::abs(facing) <= .001) return { false, 0 };
+    float d = ((planar.center - orig) * planar.normal) / facing;
+    if (d <= .001) return { false, 0 };
+    if (planar.shape == PLANE_INFINITE) return { true, d };
+    vec3 offset = orig + dir * d - planar.center;
+    float s = offset * planar.u, t = offset * planar.v;
+    bool inside = planar.shape == PLANE_RECT ? std::abs(s) < planar.half_u && std::abs(t) < planar.half_v : s * s + t * t < planar.half_u * planar.half_u;
+    return { inside, d };
+}
+
+// Nearest infinite plane hit closer than nearest_dist; updates nearest_dist and returns its primitive, or nullptr
+const Primitive* unbounded_intersect(const vec3& orig, const vec3& dir, float& nearest_dist) {
+    const Primitive* nearest = nullptr;
+    for (const Primitive& p : scene.unbounded) {
+        auto [hit, d] = ray_planar_intersect(orig, dir, scene.planars[p.index]);
+        if (hit && d < nearest_dist) {
+            nearest_dist = d;
+            nearest = &p;
+        }
+    }
+    return nearest;
+}
 
-    float tymin = (c.center.y - c.size / 2 - orig.y) / dir.y;
-    float tymax = (c.center.y + c.size / 2 - orig.y) / dir.y;
-    if (tymin > tymax) std::swap(tymin, tymax);
+// Colour of a texture at hit point pt with surface coordinates (u, v). footprint is the size of the shaded area in
+// surface units and picks the mip level of image textures.
+vec3 texture_color(const Texture& texture, const vec3& pt, const float u, const float v, const float footprint) {
+    if (texture.kind == TEXTURE_CHECKER) {
+        int parity = int(std::floor(u / texture.scale)) + int(std::floor(v / texture.scale));
+        return parity & 1 ? texture.color_a : texture.color_b;
+    }
+    if (texture.kind == TEXTURE_MARBLE) {
+        const vec3 q = pt * (1 / texture.scale);
+        float t = .5f + .5f * std::sin(6.2831853f * q.x + texture.turbulence * turbulence(q));
+        return texture.color_a * (1 - t) + texture.color_b * t;
+    }
+    TextureImage& image = *scene.images[texture.image];
+    return sample_image(image, u / texture.scale, v / texture.scale, footprint / texture.scale * image.width);
+}
 
-    if ((tmin > tymax) || (tymin > tmax))
-        return { false, 0, vec3{0, 0, 0} };
+// Nearest hit found by traversal; the normal and diffuse colour are derived from it when it is shaded
+struct HitRecord {
+    float t = 1e10f;
+    int prim = -1; // index into scene.bvh.prims, -2 - i for scene.unbounded[i], -1 for a miss
+    int triangle = -1; // triangle within the mesh when prim is a mesh
+    int material = -1;
+    float u = 0, v = 0; // barycentric coordinates of a triangle hit
 
-    if (tymin > tmin)
-        tmin = tymin;
+    bool hit() const { return prim != -1 && t < 1000; }
+};
 
-    if (tymax < tmax)
-        tmax = tymax;
+// Primitive behind a HitRecord::prim id, nullptr for a miss
+const Primitive* hit_primitive(const int prim) {
+    return prim >= 0 ? &scene.bvh.prims[prim] : prim == -1 ? nullptr : &scene.unbounded[-2 - prim];
+}
 
-    float tzmin = (c.center.z - c.size / 2 - orig.z) / dir.z;
-    float tzmax = (c.center.z + c.size / 2 - orig.z) / dir.z;
-    if (tzmin > tzmax) std::swap(tzmin, tzmax);
+int hit_id(const Primitive* p) {
+    return !p ? -1 : p >= scene.unbounded.data() && p < scene.unbounded.data() + scene.unbounded.size() ? -2 - int(p - scene.unbounded.data())
+                                                                                                         : int(p - scene.bvh.prims.data());
+}
 
-    if ((tmin > tzmax) || (tzmin > tmax))
-        return { false, 0, vec3{0, 0, 0} };
+int primitive_material(const Primitive& p) {
+    switch (p.type) {
+    case SPHERE: return scene.spheres.material[p.index];
+    case CUBE: return scene.cubes.material[p.index];
+    case PLANAR: return scene.planars[p.index].material;
+    default: return scene.meshes[p.index].material;
+    }
+}
 
-    if (tzmin > tmin)
-        tmin = tzmin;
+// Completes a record once traversal has settled on the nearest hit, looking up its material once
+HitRecord make_hit(const float t, const int prim, const int triangle, const float* barycentric) {
+    HitRecord hit;
+    hit.t = t;
+    hit.prim = prim;
+    if (prim == -1) return hit;
+    hit.material = primitive_material(*hit_primitive(prim));
+    if (triangle >= 0) {
+        hit.triangle = triangle;
+        hit.u = barycentric[0];
+        hit.v = barycentric[1];
+    }
+    return hit;
+}
 
-    if (tzmax < tmax)
-        tmax = tzmax;
+// Geometric normal at a hit on the ray orig + dir * t
+vec3 hit_normal(const HitRecord& hit, const vec3& orig, const vec3& dir) {
+    const Primitive& p = *hit_primitive(hit.prim);
+    if (p.type == PLANAR) return scene.planars[p.index].normal;
+    if (p.type == SPHERE) return (orig + dir * hit.t - scene.spheres.center(p.index)).normalized();
+    if (p.type == CUBE) return std::get<2>(ray_cube_intersect(Ray(orig, dir), scene.cubes, p.index));
+    return scene.meshes[p.index].normal(hit.triangle);
+}
 
-    vec3 N;
-    if (tmin > 0) {
-        N = vec3{
-            (tmin == (c.center.x - c.size / 2 - orig.x) / dir.x || tmin == (c.center.x + c.size / 2 - orig.x) / dir.x) ? 1.0f : 0.0f,
-            (tmin == (c.center.y - c.size / 2 - orig.y) / dir.y || tmin == (c.center.y + c.size / 2 - orig.y) / dir.y) ? 1.0f : 0.0f,
-            (tmin == (c.center.z - c.size / 2 - orig.z) / dir.z || tmin == (c.center.z + c.size / 2 - orig.z) / dir.z) ? 1.0f : 0.0f
-        };
-        return { true, tmin, N };
+// Diffuse colour at hit point pt with normal N: the material's own, or its texture evaluated at the hit
+vec3 hit_diffuse(const HitRecord& hit, const vec3& pt, const vec3& N, const vec3& dir) {
+    const Material& material = scene.materials[hit.material];
+    if (material.texture < 0) return material.diffuse_color;
+    const Primitive& p = *hit_primitive(hit.prim);
+    float u = 0, v = 0, units = 1; // surface coordinates, and surface units per world unit
+    if (p.type == PLANAR) {
+        const Planar& planar = scene.planars[p.index];
+        u = pt * planar.u;
+        v = pt * planar.v;
+    } else if (p.type == SPHERE) {
+        // Longitude and latitude, each running from 0 to 1
+        u = .5f + std::atan2(N.z, N.x) * .15915494f;
+        v = .5f + std::asin(std::max(-1.f, std::min(1.f, N.y))) * .31830989f;
+        units = .15915494f / scene.spheres.radius[p.index];
+    } else {
+        // Projected along the dominant normal axis
+        int axis = std::abs(N.x) > std::abs(N.y) ? (std::abs(N.x) > std::abs(N.z) ? 0 : 2) : (std::abs(N.y) > std::abs(N.z) ? 1 : 2);
+        u = pt[axis == 0 ? 2 : 0];
+        v = pt[axis == 1 ? 2 : 1];
     }
-    return { false, 0, vec3{0, 0, 0} };
+    // The pixel's footprint grows with distance and as the surface turns away from the ray
+    float footprint = hit.t * scene.camera.pixel_angle / std::max(std::abs(dir * N), .05f) * units;
+    return texture_color(scene.textures[material.texture], pt, u, v, footprint);
 }
 
 // Scene intersection function
-std::tuple<bool, vec3, vec3, Material> scene_intersect(const vec3& orig, const vec3& dir) {
-    vec3 pt, N;
-    Material material;
-
+HitRecord scene_intersect(const vec3& orig, const vec3& dir) {
     float nearest_dist = 1e10;
-    if (std::abs(dir.y) > .001) {
-        float d = -(orig.y + 3) / dir.y;
-        vec3 p = orig + dir * d;
-        if (d > .001 && d < nearest_dist && std::abs(p.x) < 12 && p.z < -12 && p.z > -28) {
+    const Primitive* nearest = unbounded_intersect(orig, dir, nearest_dist);
+
+    const Ray ray(orig, dir);
+    int nearest_triangle = -1;
+    float barycentric[2] = {};
+    scene.bvh.traverse(ray, nearest_dist, [&](const Primitive& p) {
+        if (p.type == SPHERE) {
+            auto [intersection, d] = ray_sphere_intersect(orig, dir, scene.spheres.center(p.index), scene.spheres.radius[p.index]);
+            if (!intersection || d > nearest_dist) return false;
             nearest_dist = d;
-            pt = p;
-            N = { 0, 1, 0 };
-            material.diffuse_color = (int(.5 * pt.x + 1000) + int(.5 * pt.z)) & 1 ? vec3{.4, .4, .4} : vec3{.4, .3, .2};
+        } else if (p.type == CUBE) {
+            auto [cube_hit, cube_dist, cube_norm] = ray_cube_intersect(ray, scene.cubes, p.index);
+            if (!cube_hit || cube_dist >= nearest_dist) return false;
+            nearest_dist = cube_dist;
+        } else if (p.type == PLANAR) {
+            auto [planar_hit, planar_dist] = ray_planar_intersect(orig, dir, scene.planars[p.index]);
+            if (!planar_hit || planar_dist >= nearest_dist) return false;
+            nearest_dist = planar_dist;
+        } else if (!scene.meshes[p.index].intersect(ray, nearest_dist, nearest_triangle, barycentric)) {
+            return false;
         }
-    }
+        nearest = &p;
+        return false;
+    });
+    return make_hit(nearest_dist, hit_id(nearest), nearest && nearest->type == MESH ? nearest_triangle : -1, barycentric);
+}
+
+// Occlusion query: true as soon as any primitive blocks the ray before tmax
+bool occluded(const vec3& orig, const vec3& dir, const float tmax) {
+    float limit = std::min(tmax, 1000.f);
+    if (unbounded_intersect(orig, dir, limit)) return true;
+
+    const Ray ray(orig, dir);
+    bool blocked = false;
+    scene.bvh.traverse(ray, limit, [&](const Primitive& p) {
+        if (p.type == SPHERE) {
+            auto [intersection, d] = ray_sphere_intersect(orig, dir, scene.spheres.center(p.index), scene.spheres.radius[p.index]);
+            blocked = intersection && d < limit;
+        } else if (p.type == CUBE) {
+            auto [cube_hit, cube_dist, cube_norm] = ray_cube_intersect(ray, scene.cubes, p.index);
+            blocked = cube_hit && cube_dist < limit;
+        } else if (p.type == PLANAR) {
+            auto [planar_hit, planar_dist] = ray_planar_intersect(orig, dir, scene.planars[p.index]);
+            blocked = planar_hit && planar_dist < limit;
+        } else {
+            float t = limit;
+            int triangle;
+            blocked = scene.meshes[p.index].intersect<true>(ray, t, triangle);
+        }
+        return blocked;
+    });
+    return blocked;
+}
+
+// Bundle of coherent rays in structure-of-arrays layout, one lane per ray
+constexpr int packet_size = 16;
+
+struct RayPacket {
+    alignas(64) float ox[packet_size], oy[packet_size], oz[packet_size];
+    alignas(64) float dx[packet_size], dy[packet_size], dz[packet_size];
+    alignas(64) float t[packet_size];
+    alignas(64) int prim[packet_size]; // index into scene.bvh.prims, -2 - i for scene.unbounded[i], -1 for a miss
+    alignas(64) int triangle[packet_size]; // triangle within the mesh when prim is a mesh
+    alignas(64) float barycentric[packet_size][2];
+    int size = 0;
+};
+
+// Packet kernel: intersects every lane with one sphere, keeping the nearest t and primitive per lane
+using SpherePacketKernel = void (*)(RayPacket& packet, const SphereSoA& spheres, const int sphere, const int prim);
 
-    for (const Sphere& s : spheres) {
-        auto [intersection, d] = ray_sphere_intersect(orig, dir, s);
-        if (!intersection || d > nearest_dist) continue;
-        nearest_dist = d;
-        pt = orig + dir * nearest_dist;
-        N = (pt - s.center).normalized();
-        material = s.material;
+void sphere_packet_scalar(RayPacket& packet, const SphereSoA& spheres, const int sphere, const int prim) {
+    const vec3 center = spheres.center(sphere);
+    const float radius = spheres.radius[sphere];
+    for (int i = 0; i < packet.size; i++) {
+        auto [intersection, d] = ray_sphere_intersect({ packet.ox[i], packet.oy[i], packet.oz[i] }, { packet.dx[i], packet.dy[i], packet.dz[i] }, center, radius);
+        if (!intersection || d > packet.t[i]) continue;
+        packet.t[i] = d;
+        packet.prim[i] = prim;
     }
+}
 
-    auto [cube_hit, cube_dist, cube_norm] = ray_cube_intersect(orig, dir, cube);
-    if (cube_hit && cube_dist < nearest_dist) {
-        nearest_dist = cube_dist;
-        pt = orig + dir * nearest_dist;
-        N = cube_norm;
-        material = cube.material;
+#if RT_SIMD_X86
+RT_TARGET("avx2")
+void sphere_packet_avx2(RayPacket& packet, const SphereSoA& spheres, const int sphere, const int prim) {
+    const float radius = spheres.radius[sphere];
+    const __m256 cx = _mm256_set1_ps(spheres.center_x[sphere]), cy = _mm256_set1_ps(spheres.center_y[sphere]), cz = _mm256_set1_ps(spheres.center_z[sphere]);
+    const __m256 r2 = _mm256_set1_ps(radius * radius), eps = _mm256_set1_ps(.001f), zero = _mm256_setzero_ps();
+    const __m256 id = _mm256_castsi256_ps(_mm256_set1_epi32(prim));
+    for (int i = 0; i < packet_size; i += 8) {
+        __m256 lx = _mm256_sub_ps(cx, _mm256_load_ps(packet.ox + i));
+        __m256 ly = _mm256_sub_ps(cy, _mm256_load_ps(packet.oy + i));
+        __m256 lz = _mm256_sub_ps(cz, _mm256_load_ps(packet.oz + i));
+        __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, _mm256_load_ps(packet.dx + i)), _mm256_mul_ps(ly, _mm256_load_ps(packet.dy + i))), _mm256_mul_ps(lz, _mm256_load_ps(packet.dz + i)));
+        __m256 ll = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+        __m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+        __m256 thc = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(r2, d2), zero));
+        __m256 t0 = _mm256_sub_ps(tca, thc), t1 = _mm256_add_ps(tca, thc);
+        __m256 d = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, eps, _CMP_GT_OQ));
+        __m256 t = _mm256_load_ps(packet.t + i);
+        __m256 accept = _mm256_and_ps(_mm256_cmp_ps(d2, r2, _CMP_LE_OQ), _mm256_and_ps(_mm256_cmp_ps(d, eps, _CMP_GT_OQ), _mm256_cmp_ps(d, t, _CMP_LE_OQ)));
+        _mm256_store_ps(packet.t + i, _mm256_blendv_ps(t, d, accept));
+        __m256 p = _mm256_load_ps(reinterpret_cast<const float*>(packet.prim + i));
+        _mm256_store_ps(reinterpret_cast<float*>(packet.prim + i), _mm256_blendv_ps(p, id, accept));
     }
+}
 
-    return { nearest_dist < 1000, pt, N, material };
+RT_TARGET("avx512f")
+void sphere_packet_avx512(RayPacket& packet, const SphereSoA& spheres, const int sphere, const int prim) {
+    const float radius = spheres.radius[sphere];
+    const __m512 cx = _mm512_set1_ps(spheres.center_x[sphere]), cy = _mm512_set1_ps(spheres.center_y[sphere]), cz = _mm512_set1_ps(spheres.center_z[sphere]);
+    const __m512 r2 = _mm512_set1_ps(radius * radius), eps = _mm512_set1_ps(.001f), zero = _mm512_setzero_ps();
+    __m512 lx = _mm512_sub_ps(cx, _mm512_load_ps(packet.ox));
+    __m512 ly = _mm512_sub_ps(cy, _mm512_load_ps(packet.oy));
+    __m512 lz = _mm512_sub_ps(cz, _mm512_load_ps(packet.oz));
+    __m512 tca = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, _mm512_load_ps(packet.dx)), _mm512_mul_ps(ly, _mm512_load_ps(packet.dy))), _mm512_mul_ps(lz, _mm512_load_ps(packet.dz)));
+    __m512 ll = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, lx), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lz, lz));
+    __m512 d2 = _mm512_sub_ps(ll, _mm512_mul_ps(tca, tca));
+    __m512 thc = _mm512_sqrt_ps(_mm512_max_ps(_mm512_sub_ps(r2, d2), zero));
+    __m512 t0 = _mm512_sub_ps(tca, thc), t1 = _mm512_add_ps(tca, thc);
+    __m512 d = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, eps, _CMP_GT_OQ), t1, t0);
+    __m512 t = _mm512_load_ps(packet.t);
+    __mmask16 accept = _mm512_cmp_ps_mask(d2, r2, _CMP_LE_OQ) & _mm512_cmp_ps_mask(d, eps, _CMP_GT_OQ) & _mm512_cmp_ps_mask(d, t, _CMP_LE_OQ);
+    _mm512_store_ps(packet.t, _mm512_mask_blend_ps(accept, t, d));
+    _mm512_store_si512(packet.prim, _mm512_mask_blend_epi32(accept, _mm512_load_si512(packet.prim), _mm512_set1_epi32(prim)));
 }
+#endif
 
-// Cast ray function
-vec3 cast_ray(const vec3& orig, const vec3& dir, const int depth = 0) {
-    auto [hit, point, N, material] = scene_intersect(orig, dir);
-    if (depth > 4 || !hit)
-        return { 0.2, 0.7, 0.8 };
+// Runtime CPU feature check for the packet kernels
+bool cpu_supports(const std::string& isa) {
+#if RT_SIMD_X86 && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (isa == "avx2") return __builtin_cpu_supports("avx2");
+    if (isa == "avx512") return __builtin_cpu_supports("avx512f");
+#elif RT_SIMD_X86 && defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 0, 0);
+    if (info[0] < 7) return false;
+    __cpuidex(info, 1, 0);
+    if (!(info[2] & (1 << 27))) return false; // OS does not save extended registers
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if (isa == "avx2") return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5));
+    if (isa == "avx512") return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16));
+#endif
+    return isa == "scalar";
+}
 
-    vec3 reflect_dir = reflect(dir, N).normalized();
-    vec3 refract_dir = refract(dir, N, material.refractive_index).normalized();
-    vec3 reflect_color = cast_ray(point, reflect_dir, depth + 1);
-    vec3 refract_color = cast_ray(point, refract_dir, depth + 1);
+struct PacketIsa {
+    std::string name;
+    SpherePacketKernel sphere_kernel;
+};
 
-    float diffuse_light_intensity = 0, specular_light_intensity = 0;
-    for (const vec3& light : lights) {
-        vec3 light_dir = (light - point).normalized();
-        auto [hit, shadow_pt, trashnrm, trashmat] = scene_intersect(point, light_dir);
-        if (hit && (shadow_pt - point).norm() < (light - point).norm()) continue;
-        diffuse_light_intensity += std::max(0.f, light_dir * N);
-        specular_light_intensity += std::pow(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent);
+// Picks the widest supported kernel, or the requested one when the CPU has it
+PacketIsa select_packet_isa(const std::string& requested) {
+    std::vector<PacketIsa> candidates;
+#if RT_SIMD_X86
+    candidates.push_back({ "avx512", sphere_packet_avx512 });
+    candidates.push_back({ "avx2", sphere_packet_avx2 });
+#endif
+    candidates.push_back({ "scalar", sphere_packet_scalar });
+    for (const PacketIsa& isa : candidates)
+        if ((requested == "auto" || requested == isa.name) && cpu_supports(isa.name)) return isa;
+    std::cerr << "Packet ISA '" << requested << "' is not available, using scalar\n";
+    return candidates.back();
+}
+
+PacketIsa packet_isa = { "scalar", sphere_packet_scalar };
+
+// Nearest-hit query for a whole packet; lanes past packet.size are padded so they never hit
+void intersect_packet(RayPacket& packet) {
+    Ray rays[packet_size];
+    for (int i = 0; i < packet_size; i++) {
+        if (i >= packet.size) {
+            packet.ox[i] = packet.oy[i] = packet.oz[i] = packet.dx[i] = packet.dy[i] = 0;
+            packet.dz[i] = 1;
+            packet.t[i] = 0;
+            packet.prim[i] = -1;
+            continue;
+        }
+        rays[i] = Ray({ packet.ox[i], packet.oy[i], packet.oz[i] }, { packet.dx[i], packet.dy[i], packet.dz[i] });
+        packet.t[i] = 1e10f;
+        const Primitive* plane = unbounded_intersect(rays[i].orig, rays[i].dir, packet.t[i]);
+        packet.prim[i] = plane ? -2 - int(plane - scene.unbounded.data()) : -1;
+    }
+
+    // Nearest entry distance over all lanes, 1e30 when no lane enters the box
+    auto packet_entry = [&](const AABB& box) {
+        float nearest = 1e30f;
+        for (int i = 0; i < packet.size; i++)
+            nearest = std::min(nearest, ray_aabb_intersect(rays[i], box, packet.t[i]));
+        return nearest;
+    };
+
+    const BVH& bvh = scene.bvh;
+    if (bvh.nodes.empty() || packet_entry(bvh.nodes[0].box) == 1e30f) return;
+    int stack[64];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        const BVHNode& node = bvh.nodes[stack[--sp]];
+        if (node.count) {
+            for (int p = node.first; p < node.first + node.count; p++) {
+                const Primitive& prim = bvh.prims[p];
+                if (prim.type == SPHERE) {
+                    packet_isa.sphere_kernel(packet, scene.spheres, prim.index, p);
+                    continue;
+                }
+                if (prim.type == MESH) {
+                    for (int i = 0; i < packet.size; i++)
+                        if (scene.meshes[prim.index].intersect(rays[i], packet.t[i], packet.triangle[i], packet.barycentric[i])) packet.prim[i] = p;
+                    continue;
+                }
+                if (prim.type == PLANAR) {
+                    for (int i = 0; i < packet.size; i++) {
+                        auto [planar_hit, planar_dist] = ray_planar_intersect(rays[i].orig, rays[i].dir, scene.planars[prim.index]);
+                        if (!planar_hit || planar_dist >= packet.t[i]) continue;
+                        packet.t[i] = planar_dist;
+                        packet.prim[i] = p;
+                    }
+                    continue;
+                }
+                for (int i = 0; i < packet.size; i++) {
+                    auto [cube_hit, cube_dist, cube_norm] = ray_cube_intersect(rays[i], scene.cubes, prim.index);
+                    if (!cube_hit || cube_dist >= packet.t[i]) continue;
+                    packet.t[i] = cube_dist;
+                    packet.prim[i] = p;
+                }
+            }
+            continue;
+        }
+        int left = int(&node - bvh.nodes.data()) + 1, right = node.first;
+        float tl = packet_entry(bvh.nodes[left].box);
+        float tr = packet_entry(bvh.nodes[right].box);
+        if (tl > tr) { std::swap(tl, tr); std::swap(left, right); }
+        if (tr != 1e30f) stack[sp++] = right;
+        if (tl != 1e30f) stack[sp++] = left;
     }
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3{1., 1., 1.} * specular_light_intensity * material.albedo[1] + reflect_color * material.albedo[2] + refract_color * material.albedo[3];
 }
 
-int main() {
-    constexpr int width = 1024;
-    constexpr int height = 768;
-    constexpr float fov = 1.05;
-    std::vector<vec3> framebuffer(width * height);
-#pragma omp parallel for
-    for (int pix = 0; pix < width * height; pix++) {
-        float dir_x = (pix % width + 0.5) - width / 2.;
-        float dir_y = -(pix / width + 0.5) + height / 2.;
-        float dir_z = -height / (2. * tan(fov / 2.));
-        framebuffer[pix] = cast_ray(vec3{ 0, 0, 0 }, vec3{ dir_x, dir_y, dir_z }.normalized());
+// Hit record of one packet lane
+HitRecord packet_hit(const RayPacket& packet, const int lane) {
+    const int prim = packet.prim[lane];
+    const bool mesh = prim >= 0 && scene.bvh.prims[prim].type == MESH;
+    return make_hit(packet.t[lane], prim, mesh ? packet.triangle[lane] : -1, packet.barycentric[lane]);
+}
+
+// Ray counters accumulated per thread and flushed into the frame totals after every tile
+struct RayStats {
+    uint64_t primary = 0;
+    uint64_t secondary = 0;
+    uint64_t shadow = 0;
+    uint64_t culled = 0;
+    uint64_t avoided = 0; // lobes skipped because the material gives them zero weight
+
+    uint64_t traced() const { return primary + secondary + shadow; }
+    RayStats& operator+=(const RayStats& o) {
+        primary += o.primary;
+        secondary += o.secondary;
+        shadow += o.shadow;
+        culled += o.culled;
+        avoided += o.avoided;
+        return *this;
     }
+};
 
-    std::ofstream ofs;
-    ofs.open("out.ppm", std::ofstream::out | std::ofstream::binary);
-    ofs << "P6\n" << width << " " << height << "\n255\n";
-    for (vec3& color : framebuffer) {
-        float max = std::max(1.f, std::max(color[0], std::max(color[1], color[2])));
-        for (int chan : { 0, 1, 2 })
-            ofs << (char)(255 * color[chan] / max);
+thread_local RayStats thread_ray_stats;
+RayStats frame_ray_stats;
+std::mutex frame_ray_stats_lock;
+
+void flush_ray_stats() {
+    std::lock_guard<std::mutex> guard(frame_ray_stats_lock);
+    frame_ray_stats += thread_ray_stats;
+    thread_ray_stats = RayStats();
+}
+
+// PCG32 generator (O'Neill): 16 bytes of state, one multiply-add per draw. Each pixel seeds its own stream so path
+// traced images do not depend on the thread count or tile order.
+struct Pcg32 {
+    uint64_t state = 0, inc = 1;
+
+    Pcg32(const uint64_t seed, const uint64_t stream) : inc(stream << 1 | 1) {
+        next();
+        state += seed;
+        next();
     }
-    return 0;
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t shifted = uint32_t(((old >> 18) ^ old) >> 27), rot = uint32_t(old >> 59);
+        return (shifted >> rot) | (shifted << ((32 - rot) & 31));
+    }
+    float uniform() { return (next() >> 8) * (1.f / 16777216.f); }
+};
+
+// Seed for a random stream tied to a position, so stochastic shading of a hit point is the same on every thread
+uint64_t point_seed(const vec3& p) {
+    uint32_t bits[3];
+    std::memcpy(&bits[0], &p.x, 4);
+    std::memcpy(&bits[1], &p.y, 4);
+    std::memcpy(&bits[2], &p.z, 4);
+    uint64_t h = bits[0] * 0x9e3779b97f4a7c15ull ^ bits[1] * 0xc2b2ae3d27d4eb4full ^ bits[2] * 0x165667b19e3779f9ull;
+    return h ^ h >> 31;
+}
+
+// Secondary rays whose accumulated albedo weight falls below this are not traced
+float ray_cull_threshold = 0;
+
+// Lights drawn from the light tree per shading point; 0 shades every light, negative decides by the scene's light count
+int light_samples = -1;
+constexpr size_t light_sampling_threshold = 16;
+constexpr int default_light_samples = 4;
+
+int scene_light_samples() {
+    if (scene.lights.empty()) return 0;
+    if (light_samples >= 0) return light_samples;
+    return scene.lights.size() > light_sampling_threshold ? default_light_samples : 0;
+}
+
+// Calls visit(light, weight) for every light, or for stratified draws from the light tree weighted by 1 / (samples * pdf)
+template <typename Visit>
+void for_each_light(const vec3& point, const vec3& N, Pcg32& rng, Visit&& visit) {
+    const int samples = scene_light_samples();
+    if (!samples) {
+        for (const Light& light : scene.lights) visit(light, 1.f);
+        return;
+    }
+    for (int k = 0; k < samples; k++) {
+        float pdf;
+        int i = scene.light_tree.sample(point, N, (k + rng.uniform()) / samples, pdf);
+        visit(scene.lights[i], 1 / (pdf * samples));
+    }
+}
+
+// Pending secondary ray on the evaluation stack, weighted by the product of albedos along its path
+struct PendingRay {
+    vec3 orig, dir;
+    float weight;
+    int depth;
+};
+
+// Deepest Whitted bounce; rays spawned past it only pick up the background
+constexpr int whitted_max_depth = 4;
+
+// Whitted shading of one hit of the ray orig + dir * t: returns the unweighted direct lighting and passes the
+// refracted and reflected rays to spawn
+template <typename Spawn>
+vec3 whitted_hit(const vec3& orig, const vec3& dir, const HitRecord& hit, const float weight, const int depth, Spawn&& spawn) {
+    const vec3 point = orig + dir * hit.t, N = hit_normal(hit, orig, dir);
+    const Material& material = scene.materials[hit.material];
+
+    float diffuse_light_intensity = 0, specular_light_intensity = 0;
+    Pcg32 rng(point_seed(point), uint64_t(depth));
+    for_each_light(point, N, rng, [&](const Light& light, const float weight) {
+        vec3 light_dir = (light.position - point).normalized();
+        thread_ray_stats.shadow++;
+        if (occluded(point, light_dir, (light.position - point).norm())) return;
+        diffuse_light_intensity += weight * light.intensity * std::max(0.f, light_dir * N);
+        specular_light_intensity += weight * light.intensity * std::pow(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent);
+    });
+
+    float refract_weight = weight * material.albedo[3], reflect_weight = weight * material.albedo[2];
+    if (material.albedo[3] == 0) thread_ray_stats.avoided++;
+    else if (refract_weight < ray_cull_threshold) thread_ray_stats.culled++;
+    else spawn(PendingRay{ point, refract(dir, N, material.refractive_index).normalized(), refract_weight, depth + 1 });
+    if (material.albedo[2] == 0) thread_ray_stats.avoided++;
+    else if (reflect_weight < ray_cull_threshold) thread_ray_stats.culled++;
+    else spawn(PendingRay{ point, reflect(dir, N).normalized(), reflect_weight, depth + 1 });
+    return hit_diffuse(hit, point, N, dir) * diffuse_light_intensity * material.albedo[0] + vec3{1., 1., 1.} * specular_light_intensity * material.albedo[1];
+}
+
+// Evaluates the Whitted tree under a primary hit iteratively, with an explicit ray stack instead of recursion
+vec3 shade_hit(const vec3& primary_orig, const vec3& primary_dir, const HitRecord& primary_hit) {
+    PendingRay stack[2 * whitted_max_depth + 4];
+    int sp = 0;
+    vec3 color;
+
+    // Refraction is pushed first so the reflection subtree is evaluated first, as the recursive version did
+    auto shade = [&](const vec3& orig, const vec3& dir, const HitRecord& hit, const float weight, const int depth) {
+        if (depth > whitted_max_depth || !hit.hit()) {
+            color = color + scene.background * weight;
+            return;
+        }
+        color = color + whitted_hit(orig, dir, hit, weight, depth, [&](const PendingRay& ray) { stack[sp++] = ray; }) * weight;
+    };
+
+    thread_ray_stats.primary++;
+    shade(primary_orig, primary_dir, primary_hit, 1, 0);
+    while (sp) {
+        PendingRay ray = stack[--sp];
+        thread_ray_stats.secondary++;
+        shade(ray.orig, ray.dir, scene_intersect(ray.orig, ray.dir), ray.weight, ray.depth);
+    }
+    return color;
+}
+
+// Cast ray function
+vec3 cast_ray(const vec3& orig, const vec3& dir) {
+    return shade_hit(orig, dir, scene_intersect(orig, dir));
+}
+
+// Cosine-weighted direction on the hemisphere around N
+vec3 cosine_sample_hemisphere(const vec3& N, Pcg32& rng) {
+    float r = std::sqrt(rng.uniform()), phi = 6.2831853f * rng.uniform();
+    vec3 t = cross(std::abs(N.x) > .5f ? vec3{ 0, 1, 0 } : vec3{ 1, 0, 0 }, N).normalized(), b = cross(N, t);
+    return (t * (r * std::cos(phi)) + b * (r * std::sin(phi)) + N * std::sqrt(std::max(0.f, 1 - r * r))).normalized();
+}
+
+// Monte Carlo path tracer: next-event estimation at every vertex, one lobe sampled per bounce, Russian roulette
+vec3 trace_path(const vec3& primary_orig, const vec3& primary_dir, Pcg32& rng) {
+    constexpr int max_depth = 16, roulette_depth = 3;
+    vec3 orig = primary_orig, dir = primary_dir, throughput = { 1, 1, 1 }, color;
+    thread_ray_stats.primary++;
+    for (int depth = 0; depth < max_depth; depth++) {
+        if (depth) thread_ray_stats.secondary++;
+        HitRecord hit = scene_intersect(orig, dir);
+        if (!hit.hit()) return color + mul(throughput, scene.background);
+        const vec3 point = orig + dir * hit.t, N = hit_normal(hit, orig, dir), facing = N * dir < 0 ? N : -N;
+        const Material& material = scene.materials[hit.material];
+        const vec3 diffuse_color = hit_diffuse(hit, point, N, dir);
+
+        float diffuse_light_intensity = 0, specular_light_intensity = 0;
+        for_each_light(point, facing, rng, [&](const Light& light, const float weight) {
+            vec3 light_dir = (light.position - point).normalized();
+            if (light_dir * facing <= 0) return;
+            thread_ray_stats.shadow++;
+            if (occluded(point, light_dir, (light.position - point).norm())) return;
+            diffuse_light_intensity += weight * light.intensity * (light_dir * facing);
+            specular_light_intensity += weight * light.intensity * std::pow(std::max(0.f, -reflect(-light_dir, facing) * dir), material.specular_exponent);
+        });
+        color = color + mul(throughput, diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3{ 1, 1, 1 } * specular_light_intensity * material.albedo[1]);
+
+        vec3 diffuse = diffuse_color * material.albedo[0];
+        float lobes[3] = { std::max(diffuse.x, std::max(diffuse.y, diffuse.z)), material.albedo[2], material.albedo[3] };
+        float total = lobes[0] + lobes[1] + lobes[2];
+        if (total <= 0) break;
+        float pick = rng.uniform() * total;
+        if (pick < lobes[0]) {
+            throughput = mul(throughput, diffuse) * (total / lobes[0]);
+            dir = cosine_sample_hemisphere(facing, rng);
+        } else if (pick < lobes[0] + lobes[1]) {
+            throughput = throughput * (material.albedo[2] * total / lobes[1]);
+            dir = reflect(dir, N).normalized();
+        } else {
+            throughput = throughput * (material.albedo[3] * total / lobes[2]);
+            dir = refract(dir, N, material.refractive_index).normalized();
+        }
+        orig = point;
+
+        if (depth >= roulette_depth) {
+            float survive = std::min(.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+            if (rng.uniform() >= survive) break;
+            throughput = throughput * (1 / survive);
+        }
+    }
+    return color;
+}
+
+// Rectangular block of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Per-worker tile deque: the owner pops from the front, thieves steal from the back
+struct TileQueue {
+    std::mutex lock;
+    std::deque<int> tiles;
+};
+
+// Per-worker scheduling statistics
+struct WorkerStats {
+    int tiles = 0;
+    int stolen = 0;
+    double busy_ms = 0;
+};
+
+// Interleaves the bits of x and y (x in the even bits) into a Morton/Z-order code
+uint32_t morton_encode(const uint32_t x, const uint32_t y) {
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        return (v | (v << 1)) & 0x55555555;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Inverse of morton_encode for one coordinate: pass the code for x, or the code shifted right by one for y
+uint32_t morton_compact(uint32_t v) {
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0f0f0f0f;
+    v = (v | (v >> 4)) & 0x00ff00ff;
+    return (v | (v >> 8)) & 0xffff;
+}
+
+// Visits the points of [x0, x1) x [y0, y1) spaced step apart in Z-order
+template <typename Visit>
+void for_each_morton(const int x0, const int y0, const int x1, const int y1, const int step, Visit&& visit) {
+    uint32_t side = 1;
+    while (side * step < uint32_t(std::max(x1 - x0, y1 - y0))) side *= 2;
+    for (uint32_t code = 0; code < side * side; code++) {
+        int x = x0 + int(morton_compact(code)) * step, y = y0 + int(morton_compact(code >> 1)) * step;
+        if (x < x1 && y < y1) visit(x, y);
+    }
+}
+
+// Framebuffer stored tile by tile, so every tile's pixels are one contiguous block (row-major inside the tile) and a
+// worker never shares cache lines with its neighbours. Tiles are laid out in row-major tile order.
+struct TiledLayout {
+    int width, height, tile_size;
+
+    size_t index(const int x, const int y) const {
+        const int x0 = x - x % tile_size, y0 = y - y % tile_size;
+        const int tile_width = std::min(tile_size, width - x0), tile_height = std::min(tile_size, height - y0);
+        return size_t(y0) * width + size_t(x0) * tile_height + size_t(y - y0) * tile_width + (x - x0);
+    }
+
+    void to_row_major(const std::vector<vec3>& tiled, std::vector<vec3>& rows) const {
+        rows.resize(tiled.size());
+#pragma omp parallel for
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++) rows[x + size_t(y) * width] = tiled[index(x, y)];
+    }
+};
+
+// Splits the image into tiles and renders them on a pool of threads with work stealing. With morton set the tiles are
+// queued in Z-order, so each worker's contiguous run of tiles covers a compact patch of the image.
+template <typename RenderTile>
+std::vector<WorkerStats> render_tiles(const int width, const int height, const int tile_size, int threads, const bool morton, RenderTile&& render_tile) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size)
+        for (int x = 0; x < width; x += tile_size)
+            tiles.push_back({ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+    if (morton)
+        std::sort(tiles.begin(), tiles.end(), [&](const Tile& a, const Tile& b) {
+            return morton_encode(a.x0 / tile_size, a.y0 / tile_size) < morton_encode(b.x0 / tile_size, b.y0 / tile_size);
+        });
+
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1, std::min(threads, int(tiles.size())));
+
+    // Contiguous runs of tiles per worker keep neighbouring tiles on the same thread until stolen
+    std::vector<TileQueue> queues(threads);
+    for (int t = 0; t < threads; t++)
+        for (size_t i = tiles.size() * t / threads; i < tiles.size() * (t + 1) / threads; i++)
+            queues[t].tiles.push_back(int(i));
+
+    std::vector<WorkerStats> stats(threads);
+    auto worker = [&](const int id) {
+        for (;;) {
+            int tile = -1;
+            bool stolen = false;
+            {
+                std::lock_guard<std::mutex> guard(queues[id].lock);
+                if (!queues[id].tiles.empty()) {
+                    tile = queues[id].tiles.front();
+                    queues[id].tiles.pop_front();
+                }
+            }
+            for (int v = 1; tile < 0 && v < threads; v++) {
+                TileQueue& victim = queues[(id + v) % threads];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.tiles.empty()) {
+                    tile = victim.tiles.back();
+                    victim.tiles.pop_back();
+                    stolen = true;
+                }
+            }
+            if (tile < 0) return; // no tiles are ever added, so empty queues mean the frame is done
+
+            auto start = std::chrono::steady_clock::now();
+            render_tile(tiles[tile]);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            stats[id].tiles++;
+            stats[id].stolen += stolen;
+            stats[id].busy_ms += elapsed.count();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(worker, t);
+    worker(0);
+    for (std::thread& th : pool) th.join();
+    return stats;
+}
+
+// Converts the framebuffer to 8-bit RGB in one contiguous buffer, scaling over-bright pixels by their largest channel
+std::vector<uint8_t> to_rgb8(const std::vector<vec3>& framebuffer) {
+    std::vector<uint8_t> rgb(framebuffer.size() * 3);
+    const int pixels = int(framebuffer.size());
+#pragma omp parallel for
+    for (int pix = 0; pix < pixels; pix++) {
+        const vec3& color = framebuffer[pix];
+        float max = std::max(1.f, std::max(color[0], std::max(color[1], color[2])));
+        for (int chan : { 0, 1, 2 })
+            rgb[pix * 3 + chan] = uint8_t(255 * color[chan] / max);
+    }
+    return rgb;
+}
+
+// Image encoders: each turns the framebuffer into the complete file contents
+using ImageEncoder = std::vector<uint8_t> (*)(const std::vector<vec3>& framebuffer, const int width, const int height);
+
+void append(std::vector<uint8_t>& out, const std::string& text) {
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+std::vector<uint8_t> encode_ppm(const std::vector<vec3>& framebuffer, const int width, const int height) {
+    std::vector<uint8_t> out;
+    append(out, "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n");
+    std::vector<uint8_t> rgb = to_rgb8(framebuffer);
+    out.insert(out.end(), rgb.begin(), rgb.end());
+    return out;
+}
+
+// Portable float map: unclamped linear HDR values, little endian, rows stored bottom to top
+std::vector<uint8_t> encode_pfm(const std::vector<vec3>& framebuffer, const int width, const int height) {
+    std::vector<uint8_t> out;
+    append(out, "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n");
+    size_t header = out.size();
+    out.resize(header + framebuffer.size() * 3 * sizeof(float));
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        uint8_t* row = out.data() + header + size_t(height - 1 - y) * width * 3 * sizeof(float);
+        for (int x = 0; x < width; x++) {
+            const vec3& color = framebuffer[x + y * width];
+            float values[3] = { color.x, color.y, color.z };
+            for (int chan : { 0, 1, 2 }) {
+                uint32_t bits;
+                std::memcpy(&bits, &values[chan], sizeof(bits));
+                for (int b = 0; b < 4; b++) row[(x * 3 + chan) * 4 + b] = uint8_t(bits >> (8 * b));
+            }
+        }
+    }
+    return out;
+}
+
+uint32_t crc32(const uint8_t* data, const size_t size, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void append_be32(std::vector<uint8_t>& out, const uint32_t v) {
+    for (int shift : { 24, 16, 8, 0 }) out.push_back(uint8_t(v >> shift));
+}
+
+void append_png_chunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data) {
+    append_be32(out, uint32_t(data.size()));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    append_be32(out, crc32(out.data() + start, out.size() - start));
+}
+
+// 8-bit RGB PNG; the zlib stream uses stored deflate blocks, trading file size for zero compression time
+std::vector<uint8_t> encode_png(const std::vector<vec3>& framebuffer, const int width, const int height) {
+    std::vector<uint8_t> rgb = to_rgb8(framebuffer);
+    std::vector<uint8_t> raw;
+    raw.reserve(size_t(height) * (width * 3 + 1));
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0); // filter type: none
+        raw.insert(raw.end(), rgb.begin() + size_t(y) * width * 3, rgb.begin() + size_t(y + 1) * width * 3);
+    }
+
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    for (size_t pos = 0; pos < raw.size() || pos == 0; pos += 65535) {
+        size_t len = std::min<size_t>(65535, raw.size() - pos);
+        zlib.push_back(pos + len == raw.size() ? 1 : 0);
+        zlib.push_back(uint8_t(len));
+        zlib.push_back(uint8_t(len >> 8));
+        zlib.push_back(uint8_t(~len));
+        zlib.push_back(uint8_t(~len >> 8));
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+        if (raw.empty()) break;
+    }
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    append_be32(zlib, (b << 16) | a);
+
+    std::vector<uint8_t> out = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::vector<uint8_t> ihdr;
+    append_be32(ihdr, uint32_t(width));
+    append_be32(ihdr, uint32_t(height));
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 }); // 8-bit depth, truecolour, deflate, adaptive filtering, no interlace
+    append_png_chunk(out, "IHDR", ihdr);
+    append_png_chunk(out, "IDAT", zlib);
+    append_png_chunk(out, "IEND", {});
+    return out;
+}
+
+// Picks the encoder from the output file extension
+ImageEncoder encoder_for(const std::string& path) {
+    std::string ext = path.substr(path.find_last_of('.') + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    if (ext == "png") return encode_png;
+    if (ext == "pfm") return encode_pfm;
+    if (ext == "ppm") return encode_ppm;
+    return nullptr;
+}
+
+// Encodes the whole image in memory and writes it with a single call
+bool write_image(const std::string& path, const std::vector<vec3>& framebuffer, const int width, const int height) {
+    ImageEncoder encode = encoder_for(path);
+    if (!encode) {
+        std::cerr << "Unsupported image format: " << path << " (use .ppm, .png or .pfm)\n";
+        return false;
+    }
+    std::vector<uint8_t> bytes = encode(framebuffer, width, height);
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+    if (!ofs) {
+        std::cerr << "Failed to write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Rendering options parsed from the command line
+struct RenderSettings {
+    int width = 1024;
+    int height = 768;
+    int tile_size = 16;
+    int threads = 0;
+    std::string isa = "auto";
+    bool packets = true;
+    bool wavefront = false;
+    float cull_threshold = 0;
+    int light_samples = -1;
+    std::string output = "out.ppm";
+    std::string scene = "demo";
+    std::string compile_scene;
+    bool progressive = false;
+    double budget_ms = 0;
+    int aa_samples = 1;
+    float aa_threshold = .1f;
+    std::string integrator = "whitted";
+    int spp = 16;
+    std::string order = "rows";
+    int frames = 1;
+    float aperture = -1, focus_distance = -1; // negative keeps the scene's lens
+    int lens_samples = 16;
+    size_t texture_cache_mb = 64;
+    bool move_camera = false, aim_camera = false;
+    vec3 camera_position, camera_look_at;
+
+    bool bench = false;
+    std::vector<std::string> bench_sizes;
+    std::vector<int> bench_threads;
+    std::vector<std::string> bench_scenes = { "demo", "random:10000", "mirrors" };
+    std::vector<std::string> bench_orders;
+    int bench_runs = 5;
+};
+
+std::vector<std::string> split(const std::string& list, const char sep) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    for (size_t end; (end = list.find(sep, start)) != std::string::npos; start = end + 1)
+        items.push_back(list.substr(start, end - start));
+    items.push_back(list.substr(start));
+    return items;
+}
+
+bool parse_size(const std::string& text, int& width, int& height) {
+    std::vector<std::string> dims = split(text, 'x');
+    if (dims.size() != 2) return false;
+    width = std::atoi(dims[0].c_str());
+    height = std::atoi(dims[1].c_str());
+    return width > 0 && height > 0;
+}
+
+bool parse_vec3(const std::string& text, vec3& v) {
+    std::vector<std::string> parts = split(text, ',');
+    if (parts.size() != 3) return false;
+    for (int i = 0; i < 3; i++) v[i] = float(std::atof(parts[i].c_str()));
+    return true;
+}
+
+bool parse_args(const int argc, char** argv, RenderSettings& settings) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--threads" && has_value) settings.threads = std::atoi(argv[++i]);
+        else if (arg == "--tile" && has_value) settings.tile_size = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--isa" && has_value) settings.isa = argv[++i];
+        else if (arg == "--no-packets") settings.packets = false;
+        else if (arg == "--wavefront") settings.wavefront = true;
+        else if (arg == "--cull" && has_value) settings.cull_threshold = float(std::atof(argv[++i]));
+        else if (arg == "--light-samples" && has_value) settings.light_samples = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--output" && has_value) settings.output = argv[++i];
+        else if (arg == "--texture-cache" && has_value) settings.texture_cache_mb = size_t(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--size" && has_value && parse_size(argv[i + 1], settings.width, settings.height)) i++;
+        else if (arg == "--scene" && has_value) settings.scene = argv[++i];
+        else if (arg == "--camera" && has_value && parse_vec3(argv[i + 1], settings.camera_position)) { settings.move_camera = true; i++; }
+        else if (arg == "--look-at" && has_value && parse_vec3(argv[i + 1], settings.camera_look_at)) { settings.aim_camera = true; i++; }
+        else if (arg == "--aa" && has_value) settings.aa_samples = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--aa-threshold" && has_value) settings.aa_threshold = float(std::atof(argv[++i]));
+        else if (arg == "--integrator" && has_value && (std::string(argv[i + 1]) == "whitted" || std::string(argv[i + 1]) == "path")) settings.integrator = argv[++i];
+        else if (arg == "--spp" && has_value) settings.spp = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--order" && has_value && (std::string(argv[i + 1]) == "rows" || std::string(argv[i + 1]) == "morton")) settings.order = argv[++i];
+        else if (arg == "--aperture" && has_value) settings.aperture = std::max(0.f, float(std::atof(argv[++i])));
+        else if (arg == "--focus" && has_value) settings.focus_distance = std::max(0.f, float(std::atof(argv[++i])));
+        else if (arg == "--lens-samples" && has_value) settings.lens_samples = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--frames" && has_value) settings.frames = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--progressive") settings.progressive = true;
+        else if (arg == "--budget" && has_value) settings.budget_ms = std::atof(argv[++i]);
+        else if (arg == "--compile-scene" && has_value) settings.compile_scene = argv[++i];
+        else if (arg == "--bench") settings.bench = true;
+        else if (arg == "--bench-sizes" && has_value) settings.bench_sizes = split(argv[++i], ',');
+        else if (arg == "--bench-scenes" && has_value) settings.bench_scenes = split(argv[++i], ',');
+        else if (arg == "--bench-orders" && has_value) settings.bench_orders = split(argv[++i], ',');
+        else if (arg == "--bench-runs" && has_value) settings.bench_runs = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--bench-threads" && has_value) {
+            settings.bench_threads.clear();
+            for (const std::string& n : split(argv[++i], ',')) settings.bench_threads.push_back(std::atoi(n.c_str()));
+        } else {
+            std::cerr << "Unknown or incomplete argument: " << arg << "\n"
+                      << "Usage: raytracer [--size WxH] [--scene demo|random:N|mirrors|FILE] [--threads N] [--tile N]\n"
+                      << "                 [--isa auto|avx512|avx2|scalar] [--no-packets] [--cull WEIGHT] [--output FILE.ppm|png|pfm]\n"
+                      << "                 [--progressive [--budget MS]] [--aa MAX_SAMPLES [--aa-threshold CONTRAST]]\n"
+                      << "                 [--integrator whitted|path [--spp N]] [--camera X,Y,Z] [--look-at X,Y,Z] [--order rows|morton]\n"
+                      << "                 [--aperture DIAMETER [--focus DISTANCE] [--lens-samples N]] [--frames N] [--texture-cache MB]\n"
+                      << "                 [--wavefront] [--light-samples N]\n"
+                      << "       raytracer --scene FILE --compile-scene CACHE\n"
+                      << "       raytracer --bench [--bench-sizes WxH,...] [--bench-threads N,...] [--bench-scenes NAME,...]\n"
+                      << "                           [--bench-orders rows,morton] [--bench-runs N]\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Streaming OBJ reader for v and f statements; polygons become triangle fans, vertices are scaled then offset
+bool load_obj(const std::string& path, Mesh& mesh, const vec3& offset, const float scale) {
+    std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+    if (!ifs) {
+        std::cerr << "Cannot open mesh " << path << "\n";
+        return false;
+    }
+    std::vector<char> buffer(1 << 20);
+    size_t filled = 0;
+    int line = 0;
+    auto fail = [&](const char* message) {
+        std::cerr << path << ":" << line << ": " << message << "\n";
+        return false;
+    };
+
+    // Parses one line [cur, end), ignoring anything after a '#'; returns false on malformed input
+    auto parse_line = [&](const char* cur, const char* end) {
+        end = std::find(cur, end, '#');
+        auto skip = [&]() { while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) cur++; };
+        skip();
+        if (end - cur < 2 || (cur[1] != ' ' && cur[1] != '\t')) return true;
+        if (cur[0] == 'v') {
+            vec3 v;
+            cur++;
+            for (int a = 0; a < 3; a++) {
+                skip();
+                auto [ptr, ec] = std::from_chars(cur, end, v[a]);
+                if (ec != std::errc()) return fail("malformed vertex");
+                cur = ptr;
+            }
+            mesh.vertices.push_back(v * scale + offset);
+        } else if (cur[0] == 'f') {
+            cur++;
+            uint32_t first = 0, previous = 0;
+            int corners = 0;
+            for (skip(); cur < end; skip()) {
+                long index = 0;
+                auto [ptr, ec] = std::from_chars(cur, end, index);
+                if (ec != std::errc()) return fail("malformed face");
+                cur = ptr;
+                while (cur < end && *cur != ' ' && *cur != '\t' && *cur != '\r') cur++; // texture and normal indices
+                long resolved = index < 0 ? long(mesh.vertices.size()) + index : index - 1;
+                if (index == 0 || resolved < 0 || resolved >= long(mesh.vertices.size())) return fail("face index out of range");
+                uint32_t vertex = uint32_t(resolved);
+                if (corners >= 2) mesh.indices.insert(mesh.indices.end(), { first, previous, vertex });
+                if (corners == 0) first = vertex;
+                previous = vertex;
+                corners++;
+            }
+            if (corners < 3) return fail("face with fewer than three vertices");
+        }
+        return true;
+    };
+
+    for (;;) {
+        ifs.read(buffer.data() + filled, std::streamsize(buffer.size() - filled));
+        filled += size_t(ifs.gcount());
+        const bool last = !ifs;
+        const char* begin = buffer.data();
+        const char* stop = begin + filled;
+        for (const char* newline; (newline = static_cast<const char*>(std::memchr(begin, '\n', stop - begin))); begin = newline + 1) {
+            line++;
+            if (!parse_line(begin, newline)) return false;
+        }
+        if (last) {
+            line++;
+            return begin == stop || parse_line(begin, stop);
+        }
+        // Keep the partial last line for the next chunk, growing the buffer for lines longer than a chunk
+        filled = size_t(stop - begin);
+        std::memmove(buffer.data(), begin, filled);
+        if (filled == buffer.size()) buffer.resize(buffer.size() * 2);
+    }
+}
+
+// Line-oriented scene file reader. Numbers are parsed with std::from_chars straight from the file buffer.
+class SceneParser {
+public:
+    SceneParser(const char* begin, const char* end) : cur(begin), end(end) {}
+
+    // Loads every statement into the global scene; on failure reports file:line and returns false
+    bool parse(const std::string& path) {
+        std::unordered_map<std::string, int> material_ids, texture_ids, image_ids;
+        for (; skip_blank(), cur < end;) {
+            std::string keyword = word();
+            bool ok = true;
+            if (keyword == "material") {
+                std::string name = word();
+                Material m;
+                ok = !name.empty() && number(m.refractive_index) && number(m.albedo[0]) && number(m.albedo[1]) && number(m.albedo[2]) &&
+                     number(m.albedo[3]) && vector(m.diffuse_color) && number(m.specular_exponent);
+                if (ok && !at_line_end()) {
+                    auto it = texture_ids.find(word());
+                    if (it == texture_ids.end()) return fail(path, "unknown texture");
+                    m.texture = it->second;
+                }
+                if (ok) {
+                    material_ids[name] = int(scene.materials.size());
+                    scene.materials.push_back(m);
+                }
+            } else if (keyword == "sphere" || keyword == "cube") {
+                vec3 center;
+                float size = 0;
+                ok = vector(center) && number(size);
+                auto it = material_ids.find(word());
+                if (ok && it == material_ids.end()) return fail(path, "unknown material");
+                if (ok && keyword == "sphere") scene.spheres.push_back(center, size, it->second);
+                else if (ok) scene.cubes.push_back(center, vec3{ size, size, size } * .5f, it->second, -1);
+            } else if (keyword == "mesh") {
+                std::string file = word();
+                auto it = material_ids.find(word());
+                if (file.empty() || it == material_ids.end()) return fail(path, "malformed 'mesh' statement");
+                vec3 offset;
+                float scale = 1;
+                if (!at_line_end()) ok = vector(offset);
+                if (ok && !at_line_end()) ok = number(scale);
+                file = relative_to(path, file);
+                Mesh mesh;
+                mesh.material = it->second;
+                if (ok && !load_obj(file, mesh, offset, scale)) return fail(path, "cannot load mesh " + file);
+                if (ok) scene.meshes.push_back(std::move(mesh));
+            } else if (keyword == "box") {
+                vec3 center, size, degrees;
+                ok = vector(center) && vector(size);
+                auto it = material_ids.find(word());
+                if (ok && it == material_ids.end()) return fail(path, "unknown material");
+                int rotation = -1;
+                if (ok && !at_line_end()) {
+                    ok = vector(degrees);
+                    rotation = scene.cubes.add_basis(euler_basis(degrees));
+                }
+                if (ok) scene.cubes.push_back(center, size * .5f, it->second, rotation);
+            } else if (keyword == "light") {
+                Light light;
+                ok = vector(light.position);
+                if (ok && !at_line_end()) ok = number(light.intensity);
+                if (ok) scene.lights.push_back(light);
+            } else if (keyword == "plane" || keyword == "disc" || keyword == "rect") {
+                // A plane is a point, normal and material, unless it is the older five-number checkerboard floor
+                const char* start = cur;
+                vec3 center, normal;
+                float width = 0, height = 0;
+                ok = vector(center) && vector(normal);
+                if (ok && keyword == "disc") ok = number(width);
+                if (ok && keyword == "rect") ok = number(width) && number(height);
+                auto it = material_ids.find(word());
+                if (keyword == "plane" && (!ok || it == material_ids.end())) {
+                    cur = start;
+                    float y, x_min, x_max, z_min, z_max;
+                    ok = number(y) && number(x_min) && number(x_max) && number(z_min) && number(z_max);
+                    Texture checker;
+                    if (ok && !at_line_end()) ok = vector(checker.color_a) && vector(checker.color_b);
+                    if (ok) scene.planars.push_back(floor_rect(y, x_min, x_max, z_min, z_max, scene.add_textured(Material(), checker)));
+                } else {
+                    if (ok && it == material_ids.end()) return fail(path, "unknown material");
+                    if (ok && (normal * normal == 0 || width < 0 || height < 0)) return fail(path, "degenerate '" + keyword + "'");
+                    PlanarShape shape = keyword == "plane" ? PLANE_INFINITE : keyword == "disc" ? PLANE_DISC : PLANE_RECT;
+                    Planar planar(shape, center, normal, keyword == "rect" ? width * .5f : width, height * .5f, ok ? it->second : 0);
+                    // A trailing "checker CELL ODD_RGB EVEN_RGB" textures this surface only
+                    if (ok && !at_line_end()) {
+                        Texture checker;
+                        ok = word() == "checker" && number(checker.scale) && checker.scale > 0 && vector(checker.color_a) && vector(checker.color_b);
+                        if (ok) planar.material = scene.add_textured(scene.materials[planar.material], checker);
+                    }
+                    if (ok) scene.planars.push_back(planar);
+                }
+            } else if (keyword == "texture") {
+                std::string name = word(), kind = word();
+                Texture texture;
+                if (kind == "checker") {
+                    ok = number(texture.scale) && vector(texture.color_a) && vector(texture.color_b);
+                } else if (kind == "marble") {
+                    texture.kind = TEXTURE_MARBLE;
+                    ok = number(texture.scale) && number(texture.turbulence) && vector(texture.color_a) && vector(texture.color_b);
+                } else if (kind == "image") {
+                    texture.kind = TEXTURE_IMAGE;
+                    texture.scale = 1;
+                    std::string file = relative_to(path, word());
+                    if (!at_line_end()) ok = number(texture.scale);
+                    // Textures sharing an image file share its cached tiles
+                    auto it = image_ids.find(file);
+                    if (ok && it == image_ids.end()) {
+                        std::shared_ptr<TextureImage> image = TextureImage::open(file);
+                        if (!image) return fail(path, "cannot load texture " + file);
+                        scene.images.push_back(image);
+                        it = image_ids.emplace(file, int(scene.images.size()) - 1).first;
+                    }
+                    if (ok) texture.image = it->second;
+                } else {
+                    return fail(path, "unknown texture kind '" + kind + "'");
+                }
+                ok = ok && !name.empty() && texture.scale > 0;
+                if (ok) {
+                    texture_ids[name] = int(scene.textures.size());
+                    scene.textures.push_back(texture);
+                }
+            } else if (keyword == "background") {
+                ok = vector(scene.background);
+            } else if (keyword == "camera") {
+                ok = vector(scene.camera.position) && number(scene.camera.fov);
+                scene.camera.look_at = scene.camera.position + vec3{ 0, 0, -1 };
+                if (ok && !at_line_end()) ok = vector(scene.camera.look_at);
+            } else if (keyword == "lens") {
+                ok = number(scene.camera.aperture);
+                if (ok && !at_line_end()) ok = number(scene.camera.focus_distance);
+            } else if (keyword == "keyframe") {
+                Keyframe key = {};
+                int index = 0;
+                ok = number(key.frame);
+                std::string kind = word();
+                AnimatedKind animated = ANIMATED_CAMERA;
+                size_t declared = 1;
+                if (kind == "sphere") { animated = ANIMATED_SPHERE; declared = scene.spheres.size(); }
+                else if (kind == "cube" || kind == "box") { animated = ANIMATED_CUBE; declared = scene.cubes.count(); }
+                else if (kind == "light") { animated = ANIMATED_LIGHT; declared = scene.lights.size(); }
+                else if (kind != "camera") return fail(path, "unknown keyframe object '" + kind + "'");
+                if (ok && animated != ANIMATED_CAMERA) ok = number(index);
+                if (ok && (index < 0 || size_t(index) >= declared)) return fail(path, "keyframe for undeclared " + kind + " " + std::to_string(index));
+                ok = ok && vector(key.position);
+                key.look_at = key.position + vec3{ 0, 0, -1 };
+                if (ok && animated == ANIMATED_CAMERA && !at_line_end()) ok = vector(key.look_at);
+                if (ok) {
+                    auto it = std::find_if(scene.tracks.begin(), scene.tracks.end(), [&](const Track& t) { return t.kind == animated && t.index == index; });
+                    if (it == scene.tracks.end()) it = scene.tracks.insert(scene.tracks.end(), Track{ animated, index, {} });
+                    it->insert(key);
+                }
+            } else {
+                return fail(path, "unknown statement '" + keyword + "'");
+            }
+            if (!ok || !at_line_end()) return fail(path, "malformed '" + keyword + "' statement");
+        }
+        return true;
+    }
+
+private:
+    const char* cur;
+    const char* end;
+    int line = 1;
+
+    // Skips whitespace and comments up to the next statement, counting lines
+    void skip_blank() {
+        while (cur < end) {
+            if (*cur == '#') while (cur < end && *cur != '\n') cur++;
+            else if (*cur == '\n') { line++; cur++; }
+            else if (std::isspace(static_cast<unsigned char>(*cur))) cur++;
+            else break;
+        }
+    }
+    void skip_spaces() {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) cur++;
+    }
+    bool at_line_end() {
+        skip_spaces();
+        return cur == end || *cur == '\n' || *cur == '#';
+    }
+    std::string word() {
+        skip_spaces();
+        const char* start = cur;
+        while (cur < end && !std::isspace(static_cast<unsigned char>(*cur))) cur++;
+        return std::string(start, cur);
+    }
+    template <typename T>
+    bool number(T& value) {
+        skip_spaces();
+        if (cur < end && *cur == '+') cur++;
+        auto [ptr, ec] = std::from_chars(cur, end, value);
+        if (ec != std::errc()) return false;
+        cur = ptr;
+        return true;
+    }
+    bool vector(vec3& v) { return number(v.x) && number(v.y) && number(v.z); }
+    // Resolves a relative mesh or texture path against the scene file's directory
+    static std::string relative_to(const std::string& path, const std::string& file) {
+        size_t slash = path.find_last_of("/\\");
+        if (slash == std::string::npos || file.empty() || file[0] == '/' || file[0] == '\\' || file.find(':') != std::string::npos) return file;
+        return path.substr(0, slash + 1) + file;
+    }
+    bool fail(const std::string& path, const std::string& message) {
+        std::cerr << path << ":" << line << ": " << message << "\n";
+        return false;
+    }
+};
+
+// Reads a scene description file into the global scene
+bool load_scene_file(const std::string& path) {
+    // Read in chunks rather than sized by tellg(), which is meaningless for directories and other non-regular files
+    std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+    std::string text;
+    char chunk[1 << 16];
+    while (ifs.read(chunk, sizeof(chunk)) || ifs.gcount()) text.append(chunk, size_t(ifs.gcount()));
+    if (ifs.bad() || !ifs.eof()) {
+        std::cerr << "Cannot open scene file " << path << "\n";
+        return false;
+    }
+    scene = Scene();
+    return SceneParser(text.data(), text.data() + text.size()).parse(path);
+}
+
+// Read-only memory mapping of a whole file, unmapped when the last reference goes away
+class MappedFile {
+public:
+    static std::shared_ptr<const MappedFile> open(const std::string& path) {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+        file->handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file->handle == INVALID_HANDLE_VALUE) return nullptr;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file->handle, &size) || size.QuadPart == 0) return nullptr;
+        file->mapping = CreateFileMappingA(file->handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!file->mapping) return nullptr;
+        file->ptr = static_cast<const char*>(MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0));
+        file->bytes = size_t(size.QuadPart);
+#else
+        file->fd = ::open(path.c_str(), O_RDONLY);
+        if (file->fd < 0) return nullptr;
+        struct stat st;
+        if (fstat(file->fd, &st) != 0 || st.st_size == 0) return nullptr;
+        void* ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (ptr == MAP_FAILED) return nullptr;
+        file->ptr = static_cast<const char*>(ptr);
+        file->bytes = size_t(st.st_size);
+#endif
+        return file->ptr ? file : nullptr;
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (ptr) UnmapViewOfFile(ptr);
+        if (mapping) CloseHandle(mapping);
+        if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+#else
+        if (ptr) munmap(const_cast<char*>(ptr), bytes);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    const char* data() const { return ptr; }
+    size_t size() const { return bytes; }
+
+private:
+    MappedFile() = default;
+
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    const char* ptr = nullptr;
+    size_t bytes = 0;
+};
+
+// Binary scene cache: a fixed header followed by 64-byte aligned sections holding the SoA arrays,
+// the prebuilt BVH and the material and light tables, laid out exactly as they are used in memory
+constexpr char scene_cache_magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+constexpr uint32_t scene_cache_version = 6;
+
+enum SceneCacheSection {
+    SPHERE_X, SPHERE_Y, SPHERE_Z, SPHERE_RADIUS, SPHERE_MATERIAL,
+    CUBE_X, CUBE_Y, CUBE_Z, CUBE_HALF_X, CUBE_HALF_Y, CUBE_HALF_Z, CUBE_MATERIAL, CUBE_ROTATION, CUBE_BASES,
+    BVH_NODES, BVH_PRIMS, MATERIALS, LIGHTS, PLANARS, TEXTURES, SECTION_COUNT
+};
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // 0x01020304 on the machine that wrote the file
+    uint32_t element_size[SECTION_COUNT]; // guards against layout changes between builds
+    uint64_t offset[SECTION_COUNT];
+    uint64_t count[SECTION_COUNT];
+    int32_t bvh_depth;
+    vec3 background;
+    Camera camera;
+};
+
+// Pointer, element size and element count of every cache section in the current scene
+void scene_sections(const void* data[SECTION_COUNT], uint32_t size[SECTION_COUNT], uint64_t count[SECTION_COUNT]) {
+    auto set = [&](const SceneCacheSection section, const void* ptr, const uint32_t element_size, const size_t n) {
+        data[section] = ptr;
+        size[section] = element_size;
+        count[section] = n;
+    };
+    const SphereSoA& sp = scene.spheres;
+    const CubeSoA& cu = scene.cubes;
+    set(SPHERE_X, sp.center_x.data(), sizeof(float), sp.size());
+    set(SPHERE_Y, sp.center_y.data(), sizeof(float), sp.size());
+    set(SPHERE_Z, sp.center_z.data(), sizeof(float), sp.size());
+    set(SPHERE_RADIUS, sp.radius.data(), sizeof(float), sp.size());
+    set(SPHERE_MATERIAL, sp.material.data(), sizeof(int), sp.size());
+    set(CUBE_X, cu.center_x.data(), sizeof(float), cu.count());
+    set(CUBE_Y, cu.center_y.data(), sizeof(float), cu.count());
+    set(CUBE_Z, cu.center_z.data(), sizeof(float), cu.count());
+    set(CUBE_HALF_X, cu.half_x.data(), sizeof(float), cu.count());
+    set(CUBE_HALF_Y, cu.half_y.data(), sizeof(float), cu.count());
+    set(CUBE_HALF_Z, cu.half_z.data(), sizeof(float), cu.count());
+    set(CUBE_MATERIAL, cu.material.data(), sizeof(int), cu.count());
+    set(CUBE_ROTATION, cu.rotation.data(), sizeof(int), cu.count());
+    set(CUBE_BASES, cu.bases.data(), sizeof(Basis), cu.bases.size());
+    set(BVH_NODES, scene.bvh.nodes.data(), sizeof(BVHNode), scene.bvh.nodes.size());
+    set(BVH_PRIMS, scene.bvh.prims.data(), sizeof(Primitive), scene.bvh.prims.size());
+    set(MATERIALS, scene.materials.data(), sizeof(Material), scene.materials.size());
+    set(LIGHTS, scene.lights.data(), sizeof(Light), scene.lights.size());
+    set(PLANARS, scene.planars.data(), sizeof(Planar), scene.planars.size());
+    set(TEXTURES, scene.textures.data(), sizeof(Texture), scene.textures.size());
+}
+
+uint64_t align64(const uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// Writes the current scene, including its built BVH, as a binary scene cache
+bool write_scene_cache(const std::string& path) {
+    if (!scene.meshes.empty()) {
+        std::cerr << "Scene caches cannot hold triangle meshes yet\n";
+        return false;
+    }
+    if (!scene.images.empty()) {
+        std::cerr << "Scene caches cannot hold image textures yet\n";
+        return false;
+    }
+    if (!scene.tracks.empty()) {
+        std::cerr << "Scene caches cannot hold keyframe animation yet\n";
+        return false;
+    }
+    SceneCacheHeader header = {};
+    std::memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+    header.version = scene_cache_version;
+    header.byte_order = 0x01020304;
+    header.bvh_depth = scene.bvh.depth;
+    header.background = scene.background;
+    header.camera = scene.camera;
+
+    const void* data[SECTION_COUNT];
+    scene_sections(data, header.element_size, header.count);
+    uint64_t offset = align64(sizeof(header));
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        header.offset[i] = offset;
+        offset = align64(offset + header.count[i] * header.element_size[i]);
+    }
+
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    const char padding[64] = {};
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t written = sizeof(header);
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        ofs.write(padding, std::streamsize(header.offset[i] - written));
+        ofs.write(static_cast<const char*>(data[i]), std::streamsize(header.count[i] * header.element_size[i]));
+        written = header.offset[i] + header.count[i] * header.element_size[i];
+    }
+    ofs.write(padding, std::streamsize(offset - written));
+    if (!ofs) {
+        std::cerr << "Failed to write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool is_scene_cache(const std::string& path) {
+    char magic[sizeof(scene_cache_magic)] = {};
+    std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+    return ifs.read(magic, sizeof(magic)) && std::memcmp(magic, scene_cache_magic, sizeof(magic)) == 0;
+}
+
+// Maps a binary scene cache and points the scene arrays straight into the mapping, without copying or rebuilding
+bool map_scene_cache(const std::string& path) {
+    std::shared_ptr<const MappedFile> file = MappedFile::open(path);
+    if (!file || file->size() < sizeof(SceneCacheHeader)) {
+        std::cerr << "Cannot map scene cache " << path << "\n";
+        return false;
+    }
+    SceneCacheHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    scene = Scene();
+    const void* data[SECTION_COUNT];
+    uint32_t element_size[SECTION_COUNT];
+    uint64_t count[SECTION_COUNT];
+    scene_sections(data, element_size, count);
+    if (header.version != scene_cache_version || header.byte_order != 0x01020304 ||
+        std::memcmp(header.element_size, element_size, sizeof(element_size)) != 0) {
+        std::cerr << path << ": scene cache was written by an incompatible build, recompile it with --compile-scene\n";
+        return false;
+    }
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        if (header.offset[i] % 64 || header.offset[i] > file->size() || header.count[i] > (file->size() - header.offset[i]) / element_size[i]) {
+            std::cerr << path << ": scene cache is truncated or corrupt\n";
+            return false;
+        }
+    }
+    const Planar* planars = reinterpret_cast<const Planar*>(file->data() + header.offset[PLANARS]);
+    size_t bounded = std::count_if(planars, planars + header.count[PLANARS], [](const Planar& p) { return p.shape != PLANE_INFINITE; });
+    if (header.count[SPHERE_X] != header.count[SPHERE_MATERIAL] || header.count[CUBE_X] != header.count[CUBE_MATERIAL] ||
+        header.count[CUBE_X] != header.count[CUBE_ROTATION] ||
+        header.count[BVH_PRIMS] != header.count[SPHERE_X] + header.count[CUBE_X] + bounded) {
+        std::cerr << path << ": scene cache is truncated or corrupt\n";
+        return false;
+    }
+
+    auto section = [&](const SceneCacheSection i, auto& array) {
+        using T = typename std::remove_reference_t<decltype(array[0])>;
+        array.view(reinterpret_cast<const std::remove_const_t<T>*>(file->data() + header.offset[i]), size_t(header.count[i]));
+    };
+    section(SPHERE_X, scene.spheres.center_x);
+    section(SPHERE_Y, scene.spheres.center_y);
+    section(SPHERE_Z, scene.spheres.center_z);
+    section(SPHERE_RADIUS, scene.spheres.radius);
+    section(SPHERE_MATERIAL, scene.spheres.material);
+    section(CUBE_X, scene.cubes.center_x);
+    section(CUBE_Y, scene.cubes.center_y);
+    section(CUBE_Z, scene.cubes.center_z);
+    section(CUBE_HALF_X, scene.cubes.half_x);
+    section(CUBE_HALF_Y, scene.cubes.half_y);
+    section(CUBE_HALF_Z, scene.cubes.half_z);
+    section(CUBE_MATERIAL, scene.cubes.material);
+    section(CUBE_ROTATION, scene.cubes.rotation);
+    section(CUBE_BASES, scene.cubes.bases);
+    section(BVH_NODES, scene.bvh.nodes);
+    section(BVH_PRIMS, scene.bvh.prims);
+    const Material* materials = reinterpret_cast<const Material*>(file->data() + header.offset[MATERIALS]);
+    scene.materials.assign(materials, materials + header.count[MATERIALS]);
+    const Light* scene_lights = reinterpret_cast<const Light*>(file->data() + header.offset[LIGHTS]);
+    scene.lights.assign(scene_lights, scene_lights + header.count[LIGHTS]);
+    scene.planars.assign(planars, planars + header.count[PLANARS]);
+    const Texture* textures = reinterpret_cast<const Texture*>(file->data() + header.offset[TEXTURES]);
+    scene.textures.assign(textures, textures + header.count[TEXTURES]);
+    scene.collect_unbounded();
+    scene.bvh.depth = header.bvh_depth;
+    scene.background = header.background;
+    scene.camera = header.camera;
+    scene.backing = file;
+    return true;
+}
+
+// Fills the global scene from a preset (demo, random:N, mirrors), a binary scene cache or a scene file,
+// then builds the BVH unless the cache already holds one
+bool load_scene(const std::string& name, const bool verbose = true) {
+    auto start = std::chrono::steady_clock::now();
+    bool prebuilt = false;
+    scene = Scene();
+    for (const vec3& position : lights) scene.lights.push_back({ position });
+    auto add_floor = [] { scene.planars.push_back(floor_rect(floor_y, floor_x[0], floor_x[1], floor_z[0], floor_z[1], scene.add_textured(Material(), Texture()))); };
+    if (name == "demo") {
+        add_floor();
+        for (const Sphere& s : spheres) scene.add(s);
+        scene.add(cube);
+    } else if (name.rfind("random:", 0) == 0) {
+        int count = std::atoi(name.c_str() + 7);
+        if (count <= 0) return false;
+        add_floor();
+        const Material palette[] = { marble, water, shiny_red, bronze, mirror };
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> unit(0, 1);
+        float extent = std::cbrt(float(count)) * 1.5f; // keeps density roughly constant as N grows
+        for (int i = 0; i < count; i++) {
+            vec3 center = { (unit(rng) - .5f) * extent, (unit(rng) - .5f) * extent * .75f, -10 - unit(rng) * extent };
+            scene.add(Sphere{ center, .2f + unit(rng) * .4f, palette[i % 5] });
+        }
+    } else if (name == "mirrors") {
+        add_floor();
+        for (int i = 0; i < 5; i++)
+            for (int j = 0; j < 4; j++)
+                scene.add(Sphere{ { -6 + 3.f * i, -2 + 2.5f * j, -14 - 2.f * ((i + j) % 3) }, 1.1f, (i + j) % 4 ? mirror : water });
+        scene.add(cube);
+    } else if (is_scene_cache(name)) {
+        if (!map_scene_cache(name)) return false;
+        prebuilt = true;
+    } else if (!load_scene_file(name)) {
+        return false;
+    }
+    std::chrono::duration<double, std::milli> loaded = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    if (!prebuilt) scene.build_bvh();
+    scene.light_tree.build(scene.lights);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (verbose) {
+        size_t triangles = 0;
+        for (const Mesh& mesh : scene.meshes) triangles += mesh.triangle_count();
+        std::cerr << "Scene: " << scene.spheres.size() << " spheres, " << scene.cubes.count() << " cubes, " << scene.meshes.size() << " meshes ("
+                  << triangles << " triangles), " << scene.lights.size()
+                  << " lights, " << scene.materials.size() << " materials, " << scene.textures.size() << " textures, loaded in " << loaded.count() << " ms\n";
+        std::cerr << "BVH: " << scene.bvh.prims.size() << " primitives, " << scene.bvh.nodes.size() << " nodes, depth "
+                  << scene.bvh.depth << (prebuilt ? ", mapped from cache" : ", built in " + std::to_string(elapsed.count()) + " ms") << "\n";
+    }
+    return true;
+}
+
+// Stateless hash of a pixel and sample index to a float in [0, 1), so supersampling is reproducible across thread counts
+float sample_hash(uint32_t x, uint32_t y, uint32_t i) {
+    uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ i * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.f / 16777216.f);
+}
+
+// Path traced estimate of pixel (x, y): the mean of spp paths through uniformly jittered positions in the pixel, each
+// starting from a random point on the lens when the camera has an aperture
+vec3 path_trace_pixel(const int x, const int y, const int width, const int spp) {
+    Pcg32 rng(uint64_t(y) * width + x, 0x5eed);
+    const Camera& camera = scene.camera;
+    vec3 sum, orig, dir;
+    for (int s = 0; s < spp; s++) {
+        float px = x + rng.uniform(), py = y + rng.uniform();
+        if (camera.aperture > 0) camera.lens_ray(px, py, rng.uniform(), rng.uniform(), orig, dir);
+        else orig = camera.position, dir = camera.direction(px, py);
+        sum = sum + trace_path(orig, dir, rng);
+    }
+    return sum * (1.f / spp);
+}
+
+// Van der Corput radical inverse in base 2
+float radical_inverse(uint32_t i) {
+    i = (i << 16) | (i >> 16);
+    i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+    i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+    i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+    i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+    return (i >> 8) * (1.f / 16777216.f);
+}
+
+// Thin-lens estimate of pixel (x, y): the mean over a per-pixel rotated Hammersley set of lens samples
+vec3 thin_lens_pixel(const int x, const int y, const int samples, const bool packets) {
+    const Camera& camera = scene.camera;
+    const float shift_u = sample_hash(x, y, 0), shift_v = sample_hash(x, y, 1);
+    auto lens_sample = [&](const int i, vec3& orig, vec3& dir) {
+        float u = (i + .5f) / samples + shift_u, v = radical_inverse(i) + shift_v;
+        camera.lens_ray(x + .5f, y + .5f, u - int(u), v - int(v), orig, dir);
+    };
+    vec3 sum, orig[packet_size], dir[packet_size];
+    if (!packets) {
+        for (int i = 0; i < samples; i++) {
+            lens_sample(i, orig[0], dir[0]);
+            sum = sum + cast_ray(orig[0], dir[0]);
+        }
+        return sum * (1.f / samples);
+    }
+    RayPacket packet;
+    for (int first = 0; first < samples; first += packet_size) {
+        packet.size = std::min(packet_size, samples - first);
+        for (int i = 0; i < packet.size; i++) {
+            lens_sample(first + i, orig[i], dir[i]);
+            packet.ox[i] = orig[i].x;
+            packet.oy[i] = orig[i].y;
+            packet.oz[i] = orig[i].z;
+            packet.dx[i] = dir[i].x;
+            packet.dy[i] = dir[i].y;
+            packet.dz[i] = dir[i].z;
+        }
+        intersect_packet(packet);
+        for (int i = 0; i < packet.size; i++) sum = sum + shade_hit(orig[i], dir[i], packet_hit(packet, i));
+    }
+    return sum * (1.f / samples);
+}
+
+// Wall time, ray counts and scheduling statistics of one rendered frame
+struct FrameResult {
+    double ms = 0;
+    RayStats rays;
+    std::vector<WorkerStats> workers;
+};
+
+// Ray waiting in a wavefront queue, with the pixel it contributes to
+struct WavefrontRay {
+    PendingRay ray;
+    uint32_t pixel;
+};
+
+// Spreads the low 10 bits of v two zero bits apart, for 3D Morton codes
+uint32_t morton_spread3(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Direction octant in the top bits, then the Morton code of the origin quantised to 1024 steps per axis of bounds
+uint64_t wavefront_key(const PendingRay& ray, const AABB& bounds) {
+    uint32_t cell[3];
+    for (int k = 0; k < 3; k++) {
+        float extent = bounds.hi[k] - bounds.lo[k];
+        float f = extent > 0 ? (ray.orig[k] - bounds.lo[k]) / extent : 0;
+        cell[k] = uint32_t(std::min(1023.f, std::max(0.f, f * 1024)));
+    }
+    uint32_t octant = (ray.dir.x < 0) | (ray.dir.y < 0) << 1 | (ray.dir.z < 0) << 2;
+    return uint64_t(octant) << 30 | morton_spread3(cell[0]) | morton_spread3(cell[1]) << 1 | morton_spread3(cell[2]) << 2;
+}
+
+// Breadth-first Whitted rendering: each bounce of the frame is traced as one batch, sorted by wavefront_key
+FrameResult render_wavefront(const RenderSettings& settings, std::vector<vec3>& framebuffer) {
+    const int width = settings.width;
+    const int height = settings.height;
+    const vec3 eye = scene.camera.position;
+    const AABB bounds = scene.bvh.nodes.empty() ? AABB() : scene.bvh.nodes[0].box;
+    constexpr int chunk = 64 * packet_size;
+    scene.camera.set_image(width, height);
+    framebuffer.assign(size_t(width) * height, vec3{});
+    frame_ray_stats = RayStats();
+
+    auto start = std::chrono::steady_clock::now();
+    FrameResult result;
+    std::vector<WavefrontRay> queue, compacted;
+    std::vector<std::vector<WavefrontRay>> spawned;
+    std::vector<std::pair<uint64_t, uint32_t>> order; // sort key and index into compacted
+    std::vector<vec3> color;
+    for (bool primary = true; primary || !queue.empty(); primary = false) {
+        // Primary rays are generated on the fly and shade straight into the framebuffer
+        const int count = primary ? int(framebuffer.size()) : int(queue.size());
+        vec3* stage_color = primary ? framebuffer.data() : (color.resize(queue.size()), color.data());
+        spawned.resize((count + chunk - 1) / chunk);
+        std::vector<WorkerStats> workers = render_tiles(count, 1, chunk, settings.threads, false, [&](const Tile& tile) {
+            std::vector<WavefrontRay>& out = spawned[tile.x0 / chunk];
+            out.clear();
+            RayPacket packet;
+            WavefrontRay rays[packet_size];
+            for (int first = tile.x0; first < tile.x1; first += packet_size) {
+                packet.size = std::min(packet_size, tile.x1 - first);
+                for (int i = 0; i < packet.size; i++) {
+                    const int p = first + i;
+                    rays[i] = primary ? WavefrontRay{ { eye, scene.camera.direction(p % width + .5f, p / width + .5f), 1, 0 }, uint32_t(p) } : queue[p];
+                    packet.ox[i] = rays[i].ray.orig.x;
+                    packet.oy[i] = rays[i].ray.orig.y;
+                    packet.oz[i] = rays[i].ray.orig.z;
+                    packet.dx[i] = rays[i].ray.dir.x;
+                    packet.dy[i] = rays[i].ray.dir.y;
+                    packet.dz[i] = rays[i].ray.dir.z;
+                }
+                intersect_packet(packet);
+                for (int i = 0; i < packet.size; i++) {
+                    const PendingRay& ray = rays[i].ray;
+                    if (primary) thread_ray_stats.primary++;
+                    else thread_ray_stats.secondary++;
+                    HitRecord hit = packet_hit(packet, i);
+                    if (!hit.hit()) {
+                        stage_color[first + i] = scene.background * ray.weight;
+                        continue;
+                    }
+                    stage_color[first + i] = whitted_hit(ray.orig, ray.dir, hit, ray.weight, ray.depth, [&](const PendingRay& next) {
+                        out.push_back({ next, rays[i].pixel });
+                    }) * ray.weight;
+                }
+            }
+            flush_ray_stats();
+        });
+        result.workers.resize(std::max(result.workers.size(), workers.size()));
+        for (size_t t = 0; t < workers.size(); t++) {
+            result.workers[t].tiles += workers[t].tiles;
+            result.workers[t].stolen += workers[t].stolen;
+            result.workers[t].busy_ms += workers[t].busy_ms;
+        }
+        if (!primary)
+            for (size_t i = 0; i < queue.size(); i++) framebuffer[queue[i].pixel] = framebuffer[queue[i].pixel] + color[i];
+
+        // Compact the spawned rays, retire those past the last bounce, and sort the rest into the next queue
+        compacted.clear();
+        order.clear();
+        for (const std::vector<WavefrontRay>& out : spawned) {
+            for (const WavefrontRay& w : out) {
+                if (w.ray.depth > whitted_max_depth) {
+                    framebuffer[w.pixel] = framebuffer[w.pixel] + scene.background * w.ray.weight;
+                    continue;
+                }
+                order.push_back({ wavefront_key(w.ray, bounds), uint32_t(compacted.size()) });
+                compacted.push_back(w);
+            }
+        }
+        std::sort(order.begin(), order.end());
+        queue.resize(order.size());
+        for (size_t i = 0; i < order.size(); i++) queue[i] = compacted[order[i].second];
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    result.ms = elapsed.count();
+    result.rays = frame_ray_stats;
+    return result;
+}
+
+// Renders the global scene into framebuffer (width * height pixels). In Morton order pixels are visited in Z-order inside
+// each tile (packets are 4x4 blocks) and written to tile-blocked storage that is converted to row-major at the end.
+FrameResult render_frame(const RenderSettings& settings, std::vector<vec3>& framebuffer) {
+    if (settings.wavefront) return render_wavefront(settings, framebuffer);
+    const int width = settings.width;
+    const int height = settings.height;
+    const vec3 eye = scene.camera.position;
+    const bool morton = settings.order == "morton";
+    const TiledLayout layout = { width, height, settings.tile_size };
+    scene.camera.set_image(width, height);
+    std::vector<vec3> tiled;
+    std::vector<vec3>& target = morton ? tiled : framebuffer;
+    target.assign(size_t(width) * height, vec3{});
+    frame_ray_stats = RayStats();
+    auto pixel = [&](const int x, const int y) -> vec3& { return morton ? tiled[layout.index(x, y)] : framebuffer[x + size_t(y) * width]; };
+
+    auto start = std::chrono::steady_clock::now();
+    FrameResult result;
+    result.workers = render_tiles(width, height, settings.tile_size, settings.threads, morton, [&](const Tile& tile) {
+        if (settings.integrator == "path" || scene.camera.aperture > 0 || !settings.packets) {
+            auto shade_pixel = [&](const int x, const int y) {
+                if (settings.integrator == "path") pixel(x, y) = path_trace_pixel(x, y, width, settings.spp);
+                else if (scene.camera.aperture > 0) pixel(x, y) = thin_lens_pixel(x, y, settings.lens_samples, settings.packets);
+                else pixel(x, y) = cast_ray(eye, scene.camera.direction(x + .5f, y + .5f));
+            };
+            if (morton) for_each_morton(tile.x0, tile.y0, tile.x1, tile.y1, 1, shade_pixel);
+            else
+                for (int y = tile.y0; y < tile.y1; y++)
+                    for (int x = tile.x0; x < tile.x1; x++) shade_pixel(x, y);
+            flush_ray_stats();
+            return;
+        }
+        RayPacket packet;
+        vec3 dirs[packet_size];
+        int lane_x[packet_size], lane_y[packet_size];
+        auto trace_packet = [&]() {
+            for (int i = 0; i < packet.size; i++) {
+                dirs[i] = { packet.dx[i], packet.dy[i], packet.dz[i] };
+                packet.ox[i] = eye.x;
+                packet.oy[i] = eye.y;
+                packet.oz[i] = eye.z;
+            }
+            intersect_packet(packet);
+            for (int i = 0; i < packet.size; i++) pixel(lane_x[i], lane_y[i]) = shade_hit(eye, dirs[i], packet_hit(packet, i));
+        };
+        if (morton) {
+            for_each_morton(tile.x0, tile.y0, tile.x1, tile.y1, 4, [&](const int bx, const int by) {
+                packet.size = 0;
+                for_each_morton(bx, by, std::min(bx + 4, tile.x1), std::min(by + 4, tile.y1), 1, [&](const int x, const int y) {
+                    vec3 dir = scene.camera.direction(x + .5f, y + .5f);
+                    packet.dx[packet.size] = dir.x;
+                    packet.dy[packet.size] = dir.y;
+                    packet.dz[packet.size] = dir.z;
+                    lane_x[packet.size] = x;
+                    lane_y[packet.size++] = y;
+                });
+                trace_packet();
+            });
+        } else {
+            for (int y = tile.y0; y < tile.y1; y++)
+                for (int x0 = tile.x0; x0 < tile.x1; x0 += packet_size) {
+                    packet.size = std::min(packet_size, tile.x1 - x0);
+                    scene.camera.row_directions(x0 + .5f, y + .5f, packet.size, packet.dx, packet.dy, packet.dz);
+                    for (int i = 0; i < packet.size; i++) {
+                        lane_x[i] = x0 + i;
+                        lane_y[i] = y;
+                    }
+                    trace_packet();
+                }
+        }
+        flush_ray_stats();
+    });
+    if (morton) layout.to_row_major(tiled, framebuffer);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    result.ms = elapsed.count();
+    result.rays = frame_ray_stats;
+    return result;
+}
+
+// Coarse-to-fine rendering in passes of stride 16 down to 1, writing a preview after each until the budget is spent
+FrameResult render_progressive(const RenderSettings& settings, std::vector<vec3>& framebuffer) {
+    const int width = settings.width;
+    const int height = settings.height;
+    const vec3 eye = scene.camera.position;
+    scene.camera.set_image(width, height);
+    std::vector<vec3> samples(size_t(width) * height);
+    std::vector<uint8_t> traced(samples.size());
+    frame_ray_stats = RayStats();
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration<double, std::milli>(settings.budget_ms);
+    FrameResult result;
+    for (int stride = 16; stride >= 1; stride /= 2) {
+        const bool first_pass = stride == 16;
+        std::atomic<bool> expired(false);
+        result.workers = render_tiles(width, height, settings.tile_size, settings.threads, settings.order == "morton", [&](const Tile& tile) {
+            if (!first_pass && settings.budget_ms > 0 && std::chrono::steady_clock::now() > deadline) {
+                expired = true;
+                return;
+            }
+            for (int y = tile.y0 + (stride - tile.y0 % stride) % stride; y < tile.y1; y += stride)
+                for (int x = tile.x0 + (stride - tile.x0 % stride) % stride; x < tile.x1; x += stride) {
+                    size_t pix = x + size_t(y) * width;
+                    if (traced[pix]) continue;
+                    if (settings.integrator == "path") samples[pix] = path_trace_pixel(x, y, width, settings.spp);
+                    else if (scene.camera.aperture > 0) samples[pix] = thin_lens_pixel(x, y, settings.lens_samples, settings.packets);
+                    else samples[pix] = cast_ray(eye, scene.camera.direction(x + .5f, y + .5f));
+                    traced[pix] = 1;
+                }
+            flush_ray_stats();
+        });
+
+        // Fill untraced pixels from the nearest traced sample at this or a coarser stride
+        framebuffer.resize(samples.size());
+#pragma omp parallel for
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++) {
+                size_t pix = x + size_t(y) * width;
+                for (int s = stride; !traced[pix]; s *= 2) pix = x - x % s + size_t(y - y % s) * width;
+                framebuffer[x + size_t(y) * width] = samples[pix];
+            }
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Pass 1/" << stride << (expired ? " (stopped at budget)" : "") << " done at " << elapsed.count() << " ms\n";
+        if (expired || stride == 1) break;
+        write_image(settings.output, framebuffer, width, height);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    result.ms = elapsed.count();
+    result.rays = frame_ray_stats;
+    return result;
+}
+
+float luminance(const vec3& c) {
+    return .2126f * std::min(c.x, 1.f) + .7152f * std::min(c.y, 1.f) + .0722f * std::min(c.z, 1.f);
+}
+
+// Refines high-contrast pixels in rounds of 4 samples within budget_ms; returns the mean samples per pixel
+double adaptive_antialias(const RenderSettings& settings, std::vector<vec3>& framebuffer, const double budget_ms = 0) {
+    const int width = settings.width;
+    const int height = settings.height;
+    const vec3 eye = scene.camera.position;
+    scene.camera.set_image(width, height);
+    const std::vector<vec3> base = framebuffer;
+    std::vector<float> luma(base.size());
+    for (size_t i = 0; i < base.size(); i++) luma[i] = luminance(base[i]);
+
+    std::atomic<uint64_t> total_samples(base.size());
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double, std::milli>(budget_ms);
+    render_tiles(width, height, settings.tile_size, settings.threads, settings.order == "morton", [&](const Tile& tile) {
+        if (budget_ms > 0 && std::chrono::steady_clock::now() > deadline) return;
+        uint64_t tile_samples = 0;
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++) {
+                float center = luma[x + y * width], contrast = 0;
+                for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1); ny++)
+                    for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1); nx++)
+                        contrast = std::max(contrast, std::abs(luma[nx + ny * width] - center));
+                if (contrast <= settings.aa_threshold) continue;
+
+                // Welford running mean/variance of luminance, seeded with the existing centre sample
+                vec3 sum = base[x + y * width];
+                int n = 1;
+                double mean = center, m2 = 0;
+                while (n < settings.aa_samples) {
+                    // A last round short of 4 samples cannot cover the quadrants, so it jitters over the whole pixel
+                    const int round = std::min(4, settings.aa_samples - n);
+                    for (int q = 0; q < round; q++) {
+                        float jx = sample_hash(x, y, 2 * n), jy = sample_hash(x, y, 2 * n + 1);
+                        float sx = round == 4 ? x + ((q & 1) + jx) * .5f : x + jx;
+                        float sy = round == 4 ? y + ((q >> 1) + jy) * .5f : y + jy;
+                        vec3 c = cast_ray(eye, scene.camera.direction(sx, sy));
+                        sum = sum + c;
+                        n++;
+                        double l = luminance(c), delta = l - mean;
+                        mean += delta / n;
+                        m2 += delta * (l - mean);
+                    }
+                    if (std::sqrt(m2 / (n - 1) / n) < settings.aa_threshold * .25) break;
+                }
+                framebuffer[x + y * width] = sum * (1.f / n);
+                tile_samples += n - 1;
+            }
+        total_samples += tile_samples;
+        flush_ray_stats();
+    });
+    return double(total_samples) / base.size();
+}
+
+// Quoted JSON string literal, escaping quotes, backslashes (Windows paths) and control characters
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (const char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// Nearest-rank percentile of an ascending list
+double percentile(const std::vector<double>& sorted, const double p) {
+    size_t rank = size_t(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+// Hardware cache reference and miss counters for this process and the threads it starts afterwards (Linux perf events).
+// Elsewhere, or when perf events are not permitted, available() is false.
+class CacheCounters {
+public:
+    CacheCounters() {
+#ifdef __linux__
+        references = open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+        misses = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+    ~CacheCounters() {
+#ifdef __linux__
+        if (references >= 0) close(references);
+        if (misses >= 0) close(misses);
+#endif
+    }
+    CacheCounters(const CacheCounters&) = delete;
+    CacheCounters& operator=(const CacheCounters&) = delete;
+
+    bool available() const { return references >= 0 && misses >= 0; }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : { references, misses }) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Stops counting and returns the { references, misses } since start(), including threads that have exited
+    std::pair<uint64_t, uint64_t> stop() {
+        uint64_t counts[2] = { 0, 0 };
+#ifdef __linux__
+        int fds[2] = { references, misses };
+        for (int i = 0; i < 2; i++) {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) counts[i] = 0;
+        }
+#endif
+        return { counts[0], counts[1] };
+    }
+
+private:
+    int references = -1, misses = -1;
+
+#ifdef __linux__
+    static int open_counter(const uint64_t config) {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1; // render workers are started after the counter is opened
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+};
+
+// Renders every scene/size/thread-count combination several times and prints the results as JSON on stdout
+int run_benchmark(RenderSettings settings) {
+    std::vector<std::string> sizes = settings.bench_sizes;
+    if (sizes.empty()) sizes.push_back(std::to_string(settings.width) + "x" + std::to_string(settings.height));
+    std::vector<int> thread_counts = settings.bench_threads;
+    if (thread_counts.empty()) thread_counts.push_back(settings.threads > 0 ? settings.threads : int(std::max(1u, std::thread::hardware_concurrency())));
+
+    std::vector<std::string> orders = settings.bench_orders;
+    if (orders.empty()) orders.push_back(settings.order);
+    for (const std::string& order : orders)
+        if (order != "rows" && order != "morton") {
+            std::cerr << "Invalid order: " << order << "\n";
+            return 1;
+        }
+
+    std::vector<vec3> framebuffer;
+    std::ostringstream json;
+    json << "{\n  \"isa\": \"" << (settings.packets ? packet_isa.name : "none") << "\",\n  \"runs\": " << settings.bench_runs << ",\n  \"results\": [";
+    bool first = true;
+    for (const std::string& preset : settings.bench_scenes) {
+        if (!load_scene(preset, false)) {
+            std::cerr << "Cannot load scene: " << preset << "\n";
+            return 1;
+        }
+        for (const std::string& size : sizes) {
+            if (!parse_size(size, settings.width, settings.height)) {
+                std::cerr << "Invalid size: " << size << "\n";
+                return 1;
+            }
+            for (int threads : thread_counts)
+                for (const std::string& order : orders) {
+                    settings.threads = threads;
+                    settings.order = order;
+                    render_frame(settings, framebuffer); // warm-up, not reported
+                    std::vector<double> times;
+                    RayStats rays;
+                    uint64_t cache_references = 0, cache_misses = 0;
+                    bool cache_available = false;
+                    for (int run = 0; run < settings.bench_runs; run++) {
+                        CacheCounters counters;
+                        counters.start();
+                        FrameResult frame = render_frame(settings, framebuffer);
+                        auto [references, misses] = counters.stop();
+                        cache_available = counters.available();
+                        cache_references += references;
+                        cache_misses += misses;
+                        times.push_back(frame.ms);
+                        rays = frame.rays;
+                    }
+                    std::vector<double> sorted = times;
+                    std::sort(sorted.begin(), sorted.end());
+                    double mean = 0;
+                    for (double t : times) mean += t / times.size();
+                    std::cerr << preset << " " << size << " x" << threads << " threads, " << order << " order: " << mean << " ms/frame";
+                    if (cache_available) std::cerr << ", " << 100. * cache_misses / std::max<uint64_t>(1, cache_references) << "% cache misses";
+                    std::cerr << "\n";
+
+                    json << (first ? "\n" : ",\n") << "    {\"scene\": " << json_string(preset) << ", \"primitives\": " << scene.bvh.prims.size()
+                         << ", \"width\": " << settings.width << ", \"height\": " << settings.height << ", \"threads\": " << threads
+                         << ", \"order\": " << json_string(order)
+                         << ",\n     \"ms_per_frame\": {\"mean\": " << mean << ", \"min\": " << sorted.front() << ", \"p50\": " << percentile(sorted, 50)
+                         << ", \"p90\": " << percentile(sorted, 90) << ", \"p99\": " << percentile(sorted, 99) << ", \"max\": " << sorted.back() << "}"
+                         << ",\n     \"rays_per_frame\": {\"primary\": " << rays.primary << ", \"secondary\": " << rays.secondary
+                         << ", \"shadow\": " << rays.shadow << ", \"total\": " << rays.traced() << "}"
+                         << ",\n     \"rays_per_second\": " << rays.traced() / (mean / 1000) << ",\n     \"cache_per_frame\": ";
+                    if (cache_available)
+                        json << "{\"references\": " << cache_references / settings.bench_runs << ", \"misses\": " << cache_misses / settings.bench_runs
+                             << ", \"miss_rate\": " << double(cache_misses) / std::max<uint64_t>(1, cache_references) << "}}";
+                    else
+                        json << "null}";
+                    first = false;
+                }
+        }
+    }
+    json << "\n  ]\n}\n";
+    std::cout << json.str();
+    return 0;
+}
+
+// Inserts a zero-padded frame number before the extension: out.png -> out_0007.png
+std::string numbered_path(const std::string& path, const int frame) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    size_t dot = path.find_last_of('.'), slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+int main(int argc, char** argv) {
+    RenderSettings settings;
+    if (!parse_args(argc, argv, settings)) return 1;
+    packet_isa = select_packet_isa(settings.isa);
+    texture_cache.budget = settings.texture_cache_mb << 20;
+    ray_cull_threshold = settings.cull_threshold;
+    light_samples = settings.light_samples;
+    bool morton = settings.order == "morton" || std::find(settings.bench_orders.begin(), settings.bench_orders.end(), "morton") != settings.bench_orders.end();
+    if (settings.wavefront && (morton || !settings.packets))
+        std::cerr << "Wavefront rendering always traces packets in row order; --order morton and --no-packets are ignored\n";
+    if (settings.bench) return run_benchmark(settings);
+    if (!settings.compile_scene.empty()) {
+        if (!load_scene(settings.scene)) return 1;
+        if (!write_scene_cache(settings.compile_scene)) return 1;
+        std::cerr << "Wrote scene cache " << settings.compile_scene << "\n";
+        return 0;
+    }
+
+    if (!encoder_for(settings.output)) {
+        std::cerr << "Unsupported image format: " << settings.output << " (use .ppm, .png or .pfm)\n";
+        return 1;
+    }
+    if (!load_scene(settings.scene)) {
+        std::cerr << "Cannot load scene: " << settings.scene << "\n";
+        return 1;
+    }
+    Camera& camera = scene.camera;
+    if (settings.move_camera) {
+        camera.look_at = camera.look_at + settings.camera_position - camera.position; // keep the view direction
+        camera.position = settings.camera_position;
+    }
+    if (settings.aim_camera) camera.look_at = settings.camera_look_at;
+    if (settings.aperture >= 0) camera.aperture = settings.aperture;
+    if (settings.focus_distance >= 0) camera.focus_distance = settings.focus_distance;
+    if ((camera.look_at - camera.position).norm() == 0) {
+        std::cerr << "The camera cannot look at its own position\n";
+        return 1;
+    }
+    if (settings.wavefront && (settings.integrator == "path" || camera.aperture > 0 || settings.progressive)) {
+        std::cerr << "Wavefront rendering is ignored by the path tracer, with depth of field and when rendering progressively\n";
+        settings.wavefront = false;
+    }
+    if (settings.integrator == "path") std::cerr << "Path tracing with " << settings.spp << " samples per pixel\n";
+    else if (camera.aperture > 0) std::cerr << "Depth of field with " << settings.lens_samples << " lens samples per pixel\n";
+    else if (settings.wavefront) std::cerr << "Wavefront rendering, each bounce traced as one sorted batch in " << packet_isa.name << " packets of " << packet_size << "\n";
+    else if (settings.packets) std::cerr << "Primary rays traced in " << packet_isa.name << " packets of " << packet_size << "\n";
+
+    if (scene_light_samples()) std::cerr << "Sampling " << scene_light_samples() << " of " << scene.lights.size() << " lights per shading point from a light tree\n";
+
+    if (settings.progressive && settings.frames > 1) {
+        std::cerr << "Progressive rendering is ignored for animations\n";
+        settings.progressive = false;
+    }
+
+    // Each frame is encoded and written on another thread while the next one renders
+    std::vector<vec3> framebuffer;
+    std::future<bool> written;
+    bool ok = true;
+    for (int f = 0; f < settings.frames; f++) {
+        if (!scene.tracks.empty()) {
+            auto start = std::chrono::steady_clock::now();
+            scene.set_frame(float(f));
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cerr << "Frame " << f << ": BVH refit in " << elapsed.count() << " ms\n";
+        }
+        FrameResult frame = settings.progressive ? render_progressive(settings, framebuffer) : render_frame(settings, framebuffer);
+        std::cerr << "Rendered " << settings.width << "x" << settings.height << " in " << frame.ms << " ms on " << frame.workers.size() << " threads\n";
+        for (size_t t = 0; t < frame.workers.size(); t++)
+            std::cerr << "  thread " << t << ": " << frame.workers[t].tiles << " tiles (" << frame.workers[t].stolen << " stolen), "
+                      << frame.workers[t].busy_ms << " ms busy\n";
+        if (settings.aa_samples > 1 && settings.integrator == "path") {
+            std::cerr << "Adaptive anti-aliasing is ignored by the path tracer, which jitters all --spp samples\n";
+        } else if (settings.aa_samples > 1 && scene.camera.aperture > 0) {
+            std::cerr << "Adaptive anti-aliasing is ignored with depth of field\n";
+        } else if (settings.aa_samples > 1 && settings.progressive && settings.budget_ms > 0 && frame.ms >= settings.budget_ms) {
+            std::cerr << "Adaptive anti-aliasing skipped: the --budget was spent by the progressive passes\n";
+        } else if (settings.aa_samples > 1) {
+            auto start = std::chrono::steady_clock::now();
+            // A progressive render's budget also bounds the refinement pass
+            double spp = adaptive_antialias(settings, framebuffer, settings.progressive ? settings.budget_ms - frame.ms : 0);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            frame.rays = frame_ray_stats;
+            std::cerr << "Adaptive anti-aliasing: " << spp << " samples per pixel on average, " << elapsed.count() << " ms\n";
+        }
+        std::cerr << "Traced " << frame.rays.primary << " primary, " << frame.rays.secondary << " secondary and " << frame.rays.shadow << " shadow rays\n";
+        std::cerr << "Skipped " << frame.rays.avoided << " zero-weight secondary rays\n";
+        std::cerr << "Culled " << frame.rays.culled << " secondary rays below weight " << settings.cull_threshold << "\n";
+        if (!scene.images.empty())
+            std::cerr << "Texture cache: " << texture_cache.loaded << " tiles built, " << texture_cache.evicted << " evicted, "
+                      << texture_cache.resident_bytes() / 1024 << " KiB resident\n";
+        if (written.valid()) ok = written.get() && ok;
+        std::string path = settings.frames > 1 ? numbered_path(settings.output, f) : settings.output;
+        written = std::async(std::launch::async, [path, image = std::move(framebuffer), &settings]() {
+            return write_image(path, image, settings.width, settings.height);
+        });
+        framebuffer = std::vector<vec3>();
+    }
+    return written.get() && ok ? 0 : 1;
 }